@@ -4,16 +4,21 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
+#include <memory>
 #include <new>
 #include <type_traits>
+#include <utility>
 
 namespace AllocatorBuilder {
 namespace AlignedAllocator {
+// Allocations are aligned to Alignment or alignof(T), whichever is larger. Rebinding keeps Alignment, so rebinding to
+// another type and back gives the original allocator type.
 template <class T, size_t Alignment = alignof(T)>
 class AlignedAllocator {
 public:
-    static_assert(Alignment >= alignof(T), "Requested Alignment should be larger than or equal to the minimum required for T");
+    static_assert((Alignment & (Alignment - 1)) == 0, "Alignment must be a power of 2");
 
     // std::allocator_traits
     using value_type = T;
@@ -25,9 +30,9 @@ public:
     using difference_type = std::ptrdiff_t;
     using propagate_on_container_move_assignment = std::true_type;
 
-    template< class U, size_t OtherAlignment >
+    template <class U>
     struct rebind {
-        typedef AlignedAllocator<U, OtherAlignment> other;
+        typedef AlignedAllocator<U, Alignment> other;
     };
 
     using is_always_equal = std::true_type;
@@ -35,6 +40,11 @@ public:
     // custom allocator traits
     using thread_safe = std::false_type;
 
+    AlignedAllocator() = default;
+
+    template <class U, size_t OtherAlignment>
+    AlignedAllocator(const AlignedAllocator<U, OtherAlignment> &) noexcept {}
+
     pointer address(reference x) const noexcept {
         return std::addressof(x);
     }
@@ -43,6 +53,8 @@ public:
         return std::addressof(x);
     }
 
+    static const constexpr size_t kAlignment = Alignment > alignof(T) ? Alignment : alignof(T);
+
     T* allocate(std::size_t n, const void * hint) {
         // purposefully ignore hint
         return allocate(n);
@@ -51,7 +63,8 @@ public:
     T* allocate(std::size_t n) {
         void * mem = nullptr;
 
-        int ret = posix_memalign(&mem, Alignment, n * sizeof(T));
+        // posix_memalign rejects alignments smaller than a pointer
+        int ret = posix_memalign(&mem, kAlignment > sizeof(void *) ? kAlignment : sizeof(void *), n * sizeof(T));
 
         if (ret != 0) {
             throw std::bad_alloc();
@@ -78,5 +91,15 @@ public:
         p->~U();
     }
 };
+
+template <class T, size_t Alignment, class U, size_t OtherAlignment>
+bool operator==(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, OtherAlignment> &) noexcept {
+    return true;
+}
+
+template <class T, size_t Alignment, class U, size_t OtherAlignment>
+bool operator!=(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, OtherAlignment> &) noexcept {
+    return false;
+}
 } // namespace AlignedAllocator
 } // namespace AllocatorBuilder
@@ -2,12 +2,19 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <limits>
 #include <memory>
-#include <stack>
+#include <new>
+#include <ostream>
+#include <stdexcept>
 #include <utility>
 
 #include "AlignedAllocator.h"
+#include "HeapIntrospection.h"
+#include "WarmStart.h"
 
 namespace AllocatorBuilder {
 namespace BuddyAllocator {
@@ -31,6 +38,10 @@ constexpr bool IsPowerOf2(uint64_t n) {
     return n && !(n & (n - 1));
 }
 
+constexpr size_t Log2(size_t n) {
+    return n <= 1 ? 0 : 1 + Log2(n / 2);
+}
+
 namespace detail {
 template<size_t MinSize, size_t MaxSize>
 class BuddyTree {
@@ -43,75 +54,194 @@ public:
         }
 
         root_ = std::make_unique<BuddyTreeNode>(reinterpret_cast<char *>(mem), MaxSize);
+        free_blocks_[Log2(MaxSize)] = 1;
+    }
+
+    BuddyTree(const BuddyTree &) = delete;
+    BuddyTree & operator=(const BuddyTree &) = delete;
+
+    ~BuddyTree() {
+        char * mem = root_->mem();
+        root_.reset();
+        if (locked_) {
+            WarmStart::UnlockInteriorPages(mem, MaxSize);
+        }
+        free(mem);
+    }
+
+    // Faults in the whole region, and locks it if asked, so no allocation page faults later. A region smaller than a
+    // page shares its pages with other heap data, so only the pages wholly inside it are locked.
+    WarmStart::ReservationReport reserve(const WarmStart::ReserveOptions & options) {
+        auto start = std::chrono::steady_clock::now();
+
+        WarmStart::ReserveOptions prefault_only = options;
+        prefault_only.lock = false;
+
+        WarmStart::ReservationReport report;
+        WarmStart::PrepareRegion(root_->mem(), MaxSize, prefault_only, report);
+        if (options.lock && WarmStart::LockInteriorPages(root_->mem(), MaxSize, report)) {
+            locked_ = true;
+        }
+
+        report.milliseconds = WarmStart::MillisecondsSince(start);
+        return report;
     }
 
     char * allocate(size_t n) {
+        if (n > MaxSize) {
+            return nullptr;
+        }
+
         size_t needed_size = std::max(RoundUpPowerOf2(n), MinSize);
+        if (root_->largest_free() < needed_size) {
+            return nullptr;
+        }
 
+        // Every node records the largest free block below it, so the walk goes straight down to a fitting block
+        BuddyTreeNode * parents[kMaxDepth];
+        size_t depth = 0;
         BuddyTreeNode * current_node = root_.get();
-        std::stack<BuddyTreeNode *> unvisited_nodes;
 
-        auto getLastUnvisitedNode = [&unvisited_nodes, &current_node]() -> BuddyTreeNode * {
-            if (unvisited_nodes.empty()) {
-                return nullptr;
-            } else {
-                // Go back to the last unvisited node, and rerun this loop
-                BuddyTreeNode * last_unvisited_node = unvisited_nodes.top();
-                unvisited_nodes.pop();
-                return last_unvisited_node;
+        while (current_node->size() > needed_size) {
+            if (!current_node->is_occupied()) {
+                current_node->SplitNode();
+                --free_blocks_[Log2(current_node->size())];
+                free_blocks_[Log2(current_node->size()) - 1] += 2;
             }
-        };
-
-        while (current_node != nullptr) {
-            assert(current_node->size() >= MinSize);
-            if (current_node->size() == needed_size) {
-                if (current_node->is_occupied()) {
-                    current_node = getLastUnvisitedNode();
-                } else {
-                    return current_node->allocate();
-                }
+
+            parents[depth++] = current_node;
+            if (current_node->left_child()->largest_free() >= needed_size) {
+                current_node = current_node->left_child();
             } else {
-                // current_node has size bigger than what we want
-                if (current_node->is_allocated()) {
-                    current_node = getLastUnvisitedNode();
-                    // Next loop iteration
-                } else if (current_node->is_occupied()) {
-                    // At this point, left child and right child both exist
-                    unvisited_nodes.push(current_node->right_child());
-                    current_node = current_node->left_child();
-                    // Next loop iteration
-                } else {
-                    // Split node
-                    BuddyTreeNode * left_child;
-                    BuddyTreeNode * right_child;
-                    std::tie(left_child, right_child) = current_node->SplitNode();
-                    unvisited_nodes.push(right_child);
-                    current_node = left_child;
-                    // Next loop iteration
-                }
+                current_node = current_node->right_child();
             }
         }
 
-        // If we got here then we couldn't find a space big enough
-        return nullptr;
+        assert(!current_node->is_occupied());
+        --free_blocks_[Log2(needed_size)];
+        requested_bytes_ += n;
+        char * mem = current_node->allocate(n);
+
+        while (depth > 0) {
+            parents[--depth]->UpdateLargestFree();
+        }
+
+        return mem;
     }
 
     void deallocate(char * mem) {
-        // TODO
+        // Walk down to the allocated block containing mem, remembering the path so buddies can be merged on the way up
+        BuddyTreeNode * parents[kMaxDepth];
+        size_t depth = 0;
+        BuddyTreeNode * current_node = root_.get();
+
+        while (!current_node->is_allocated()) {
+            assert(current_node->is_occupied()); // mem was not allocated from this tree
+            parents[depth++] = current_node;
+            if (mem < current_node->mem() + current_node->size() / 2) {
+                current_node = current_node->left_child();
+            } else {
+                current_node = current_node->right_child();
+            }
+        }
+
+        assert(current_node->mem() == mem);
+        requested_bytes_ -= current_node->requested_size();
+        current_node->deallocate();
+        ++free_blocks_[Log2(current_node->size())];
+
+        bool merging = true;
+        while (depth > 0) {
+            BuddyTreeNode * parent = parents[--depth];
+
+            if (merging && !parent->left_child()->is_occupied() && !parent->right_child()->is_occupied()) {
+                free_blocks_[Log2(parent->size()) - 1] -= 2;
+                ++free_blocks_[Log2(parent->size())];
+                parent->MergeChildren();
+            } else {
+                merging = false;
+                parent->UpdateLargestFree();
+            }
+        }
+    }
+
+    // O(number of orders), cheap enough to sample periodically
+    HeapIntrospection::BuddyHeapStats stats() const {
+        HeapIntrospection::BuddyHeapStats stats;
+        stats.total_bytes = MaxSize;
+        stats.requested_bytes = requested_bytes_;
+
+        for (size_t order = Log2(MinSize); order <= Log2(MaxSize); ++order) {
+            stats.free_blocks[order] = free_blocks_[order];
+            stats.free_bytes += free_blocks_[order] << order;
+            if (free_blocks_[order] != 0) {
+                stats.largest_free_block = size_t(1) << order;
+            }
+        }
+
+        return stats;
+    }
+
+    // Prints the tree as one glyph per unit of MaxSize / max_glyphs bytes (at least MinSize), 64 glyphs per line.
+    // Walks the whole tree, so this is for debugging rather than sampling.
+    void dumpHeapMap(std::ostream & os, size_t max_glyphs = 1024) const {
+        size_t unit_size = std::max(MinSize, MaxSize / std::max(max_glyphs, size_t(1)));
+        size_t num_units = MaxSize / unit_size;
+
+        for (size_t unit = 0; unit < num_units; ++unit) {
+            os << HeapIntrospection::OccupancyGlyph(allocatedBytesIn(root_.get(), unit * unit_size, unit_size), unit_size);
+            if ((unit + 1) % 64 == 0 || unit + 1 == num_units) {
+                os << '\n';
+            }
+        }
     }
 
 private:
+    class BuddyTreeNode;
+
+    static const constexpr size_t kMaxDepth = Log2(MaxSize) - Log2(MinSize) + 1;
+
+    // Number of bytes in allocated blocks within [offset, offset + size) of the tree
+    static size_t allocatedBytesIn(const BuddyTreeNode * node, size_t offset, size_t size) {
+        size_t node_offset = 0;
+        while (node->size() > size && node->left_child() != nullptr) {
+            size_t half = node->size() / 2;
+            if (offset < node_offset + half) {
+                node = node->left_child();
+            } else {
+                node = node->right_child();
+                node_offset += half;
+            }
+        }
+
+        if (node->is_allocated()) {
+            return std::min(size, node->size());
+        } else if (node->left_child() == nullptr) {
+            return 0;
+        }
+
+        return allocatedBytesIn(node->left_child(), 0, size / 2) + allocatedBytesIn(node->right_child(), 0, size / 2);
+    }
+
     class BuddyTreeNode {
     public:
-        BuddyTreeNode(char * mem, size_t size) : mem_(mem), size_(size) {
+        BuddyTreeNode(char * mem, size_t size) : mem_(mem), size_(size), largest_free_(size) {
             assert(IsPowerOf2(size));
         }
 
-        char * allocate() {
+        char * allocate(size_t requested_size) {
             allocated_ = true;
+            requested_size_ = requested_size;
+            largest_free_ = 0;
             return mem_;
         }
 
+        void deallocate() {
+            allocated_ = false;
+            requested_size_ = 0;
+            largest_free_ = size_;
+        }
+
         bool is_occupied() const {
             return !(left_child_ == nullptr && right_child_ == nullptr && !allocated_);
         }
@@ -122,11 +252,18 @@ private:
 
         size_t size() const { return size_; }
 
-        BuddyTreeNode * left_child() {
+        char * mem() const { return mem_; }
+
+        size_t requested_size() const { return requested_size_; }
+
+        // Size of the largest free block in this subtree, 0 if there is none
+        size_t largest_free() const { return largest_free_; }
+
+        BuddyTreeNode * left_child() const {
             return left_child_.get();
         }
 
-        BuddyTreeNode * right_child() {
+        BuddyTreeNode * right_child() const {
             return right_child_.get();
         }
 
@@ -135,21 +272,40 @@ private:
 
             left_child_ = std::make_unique<BuddyTreeNode>(mem_, size_/2);
             right_child_ = std::make_unique<BuddyTreeNode>(mem_+size_/2, size_/2);
+            largest_free_ = size_/2;
 
             return {left_child_.get(), right_child_.get()};
         }
 
+        void MergeChildren() {
+            assert(!left_child_->is_occupied() && !right_child_->is_occupied());
+
+            left_child_.reset();
+            right_child_.reset();
+            largest_free_ = size_;
+        }
+
+        void UpdateLargestFree() {
+            largest_free_ = std::max(left_child_->largest_free(), right_child_->largest_free());
+        }
+
     private:
         char * mem_;
         size_t size_;
 
         bool allocated_ = false;
+        size_t requested_size_ = 0;
+        size_t largest_free_;
 
         std::unique_ptr<BuddyTreeNode> left_child_ = nullptr;
         std::unique_ptr<BuddyTreeNode> right_child_ = nullptr;
     };
 
     std::unique_ptr<BuddyTreeNode> root_;
+
+    size_t free_blocks_[HeapIntrospection::BuddyHeapStats::kMaxOrders] = {};
+    size_t requested_bytes_ = 0;
+    bool locked_ = false;
 };
 } // namespace detail
 
@@ -164,29 +320,27 @@ public:
     using const_reference = const T&;
     using size_type = std::size_t;
     using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
     using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
 
-    template< class U, size_t OtherMinSize, size_t OtherMaxSize >
+    template <class U>
     struct rebind {
-        typedef BuddyAllocator<U, OtherMinSize, OtherMaxSize> other;
+        typedef BuddyAllocator<U, MinSize, MaxSize> other;
     };
 
-    using is_always_equal = std::true_type;
+    using is_always_equal = std::false_type;
 
     // custom allocator traits
     using thread_safe = std::false_type;
 
     static_assert(IsPowerOf2(MinSize), "MinSize must be power of 2");
     static_assert(IsPowerOf2(MaxSize), "MaxSize must be power of 2");
-    static_assert(MinSize >= sizeof(T), "MinSize must be larger than sizeof(T)");
 
-//    // TODO Copy and Move functions, for now delete them so we dont misuse
-//    BuddyAllocator(const BuddyAllocator &) = delete;
-//    BuddyAllocator & operator=(const BuddyAllocator &) = delete;
-//
-//    BuddyAllocator(BuddyAllocator &&) = delete;
-//    BuddyAllocator & operator=(BuddyAllocator &&) = delete;
+    BuddyAllocator() : buddy_tree_(std::make_shared<detail::BuddyTree<MinSize, MaxSize>>()) {}
 
+    template <class U>
+    BuddyAllocator(const BuddyAllocator<U, MinSize, MaxSize> & other) : buddy_tree_(other.buddy_tree_) {}
 
     pointer address(reference x) const noexcept {
         return std::addressof(x);
@@ -202,11 +356,19 @@ public:
     }
 
     T* allocate(std::size_t n) {
-        return reinterpret_cast<T*>(buddy_tree_.allocate(n * sizeof(T)));
+        if (n > max_size()) {
+            throw std::length_error("Tried to allocate more than the allocator will support");
+        }
+
+        char * mem = buddy_tree_->allocate(n * sizeof(T));
+        if (mem == nullptr) {
+            throw std::bad_alloc();
+        }
+        return reinterpret_cast<T*>(mem);
     }
 
     void deallocate(T* p, std::size_t n) {
-        buddy_tree_.deallocate(p);
+        buddy_tree_->deallocate(reinterpret_cast<char *>(p));
     }
 
     size_type max_size() const noexcept {
@@ -222,9 +384,35 @@ public:
     void destroy(U * p) {
         p->~U();
     }
+
+    // Shared with every copy and rebind, so one call at startup covers them all
+    WarmStart::ReservationReport reserve(const WarmStart::ReserveOptions & options = WarmStart::ReserveOptions()) {
+        return buddy_tree_->reserve(options);
+    }
+
+    HeapIntrospection::BuddyHeapStats stats() const {
+        return buddy_tree_->stats();
+    }
+
+    void dumpHeapMap(std::ostream & os, size_t max_glyphs = 1024) const {
+        buddy_tree_->dumpHeapMap(os, max_glyphs);
+    }
+
+    template <class U>
+    bool operator==(const BuddyAllocator<U, MinSize, MaxSize> & other) const noexcept {
+        return buddy_tree_ == other.buddy_tree_;
+    }
+
+    template <class U>
+    bool operator!=(const BuddyAllocator<U, MinSize, MaxSize> & other) const noexcept {
+        return !(*this == other);
+    }
+
 private:
+    template <class U, size_t OtherMinSize, size_t OtherMaxSize>
+    friend class BuddyAllocator;
 
-    detail::BuddyTree<MinSize, MaxSize> buddy_tree_;
+    std::shared_ptr<detail::BuddyTree<MinSize, MaxSize>> buddy_tree_;
 };
 } // namespace BuddyAllocator
 } // namespace AllocatorBuilder
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace AllocatorBuilder {
+namespace CacheLineIsolatedAllocator {
+constexpr size_t kCacheLineSize = 64;
+
+// Adjacent-line prefetchers pull in cache lines in pairs, so this is the distance that actually avoids false sharing
+// on most x86 parts (the C++17 std::hardware_destructive_interference_size).
+constexpr size_t kDestructiveInterferenceSize = 2 * kCacheLineSize;
+
+namespace detail {
+template <size_t LineSize>
+struct alignas(LineSize) CacheLine {
+    char bytes[LineSize];
+};
+} // namespace detail
+
+// Rounds every allocation up to a whole number of LineSize-aligned lines, so no two allocations ever share a line.
+// Lines are carved out of slabs owned by the allocating thread, so objects allocated by different threads are also
+// never neighbours. Freed lines go on the freeing thread's free lists, so memory freed across threads drifts to the
+// freeing thread and stays there while it lives. When a thread exits its lists and the rest of its slab go to a pool
+// shared by all threads, which a thread drains before it asks BackingAllocator for a new slab. Slabs are never handed
+// back to BackingAllocator.
+template <class T, template<class> class BackingAllocator, size_t LineSize = kCacheLineSize>
+class CacheLineIsolatedAllocator {
+public:
+    static_assert(LineSize >= sizeof(void *) && (LineSize & (LineSize - 1)) == 0, "LineSize must be a power of 2");
+    static_assert(alignof(T) <= LineSize, "T is more aligned than a line");
+
+    using Line = detail::CacheLine<LineSize>;
+
+    // std::allocator_traits
+    using value_type = T;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using reference = T&;
+    using const_reference = const T&;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_move_assignment = std::true_type;
+
+    template <class U>
+    struct rebind {
+        typedef CacheLineIsolatedAllocator<U, BackingAllocator, LineSize> other;
+    };
+
+    using is_always_equal = std::true_type;
+
+    // custom allocator traits
+    using thread_safe = std::true_type;
+
+    static_assert(BackingAllocator<Line>::thread_safe::value, "Backing allocator must be thread-safe, slabs are requested from every thread");
+
+    CacheLineIsolatedAllocator() = default;
+
+    template <class U>
+    CacheLineIsolatedAllocator(const CacheLineIsolatedAllocator<U, BackingAllocator, LineSize> &) noexcept {}
+
+    pointer address(reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    const_pointer address(const_reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    T* allocate(std::size_t n, const void * hint) {
+        // purposefully ignore hint
+        return allocate(n);
+    }
+
+    T* allocate(std::size_t n) {
+        if (n > max_size()) {
+            throw std::length_error("Tried to allocate more than the allocator will support");
+        }
+
+        size_t num_lines = LinesFor(n);
+        if (num_lines > kMaxCachedLines) {
+            return reinterpret_cast<T*>(backing_allocator_.allocate(num_lines));
+        }
+
+        ThreadSlabs & slabs = threadSlabs();
+        FreeLine *& free_list = slabs.free_lists[num_lines];
+        if (free_list != nullptr) {
+            FreeLine * line = free_list;
+            free_list = line->next;
+            return reinterpret_cast<T*>(line);
+        }
+
+        if (slabs.end - slabs.bump < static_cast<std::ptrdiff_t>(num_lines)) {
+            if (adoptExitedLines(slabs, num_lines)) {
+                FreeLine * line = free_list;
+                free_list = line->next;
+                return reinterpret_cast<T*>(line);
+            }
+
+            // Keep whatever is left of the old slab for a later, smaller request
+            if (slabs.bump != slabs.end) {
+                pushFree(slabs, slabs.bump, slabs.end - slabs.bump);
+            }
+
+            slabs.bump = backing_allocator_.allocate(kLinesPerSlab);
+            slabs.end = slabs.bump + kLinesPerSlab;
+        }
+
+        Line * lines = slabs.bump;
+        slabs.bump += num_lines;
+        return reinterpret_cast<T*>(lines);
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        size_t num_lines = LinesFor(n);
+        if (num_lines > kMaxCachedLines) {
+            backing_allocator_.deallocate(reinterpret_cast<Line *>(p), num_lines);
+            return;
+        }
+
+        pushFree(threadSlabs(), reinterpret_cast<Line *>(p), num_lines);
+    }
+
+    size_type max_size() const noexcept {
+        return std::numeric_limits<size_type>::max() / LineSize * LineSize / sizeof(value_type);
+    }
+
+    template <class U, class... Args>
+    void construct(U * p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U>
+    void destroy(U * p) {
+        p->~U();
+    }
+
+    // allocate(0) still takes a line, so it returns a pointer of its own that deallocate() can put on a free list
+    static constexpr size_t LinesFor(std::size_t n) {
+        return n == 0 ? 1 : (n * sizeof(T) + LineSize - 1) / LineSize;
+    }
+
+private:
+    static const constexpr size_t kLinesPerSlab = 4096 / LineSize > 16 ? 4096 / LineSize : 16;
+    static const constexpr size_t kMaxCachedLines = 16;
+
+    struct FreeLine {
+        FreeLine * next;
+    };
+
+    // Lines of threads that have exited
+    struct ExitedLines {
+        std::mutex mutex;
+        FreeLine * free_lists[kMaxCachedLines + 1] = {};
+    };
+
+    struct ThreadSlabs {
+        Line * bump = nullptr;
+        Line * end = nullptr;
+        FreeLine * free_lists[kMaxCachedLines + 1] = {};
+
+        ~ThreadSlabs() {
+            while (bump != end) {
+                size_t num_lines = end - bump;
+                if (num_lines > kMaxCachedLines) {
+                    num_lines = kMaxCachedLines;
+                }
+                pushFree(*this, bump, num_lines);
+                bump += num_lines;
+            }
+
+            ExitedLines & exited = exitedLines();
+            std::lock_guard<std::mutex> lock(exited.mutex);
+            for (size_t num_lines = 1; num_lines <= kMaxCachedLines; ++num_lines) {
+                FreeLine * head = free_lists[num_lines];
+                if (head == nullptr) {
+                    continue;
+                }
+                FreeLine * tail = head;
+                while (tail->next != nullptr) {
+                    tail = tail->next;
+                }
+                tail->next = exited.free_lists[num_lines];
+                exited.free_lists[num_lines] = head;
+            }
+        }
+    };
+
+    static ThreadSlabs & threadSlabs() {
+        static thread_local ThreadSlabs slabs;
+        return slabs;
+    }
+
+    static ExitedLines & exitedLines() {
+        static ExitedLines exited;
+        return exited;
+    }
+
+    // Takes over every exited thread's lines of size num_lines, returns whether there were any
+    static bool adoptExitedLines(ThreadSlabs & slabs, size_t num_lines) {
+        ExitedLines & exited = exitedLines();
+        std::lock_guard<std::mutex> lock(exited.mutex);
+        slabs.free_lists[num_lines] = exited.free_lists[num_lines];
+        exited.free_lists[num_lines] = nullptr;
+        return slabs.free_lists[num_lines] != nullptr;
+    }
+
+    static void pushFree(ThreadSlabs & slabs, Line * lines, size_t num_lines) {
+        FreeLine * line = reinterpret_cast<FreeLine *>(lines);
+        line->next = slabs.free_lists[num_lines];
+        slabs.free_lists[num_lines] = line;
+    }
+
+    BackingAllocator<Line> backing_allocator_;
+};
+
+template <class T, class U, template<class> class BackingAllocator, size_t LineSize>
+bool operator==(const CacheLineIsolatedAllocator<T, BackingAllocator, LineSize> &, const CacheLineIsolatedAllocator<U, BackingAllocator, LineSize> &) {
+    return true;
+}
+
+template <class T, class U, template<class> class BackingAllocator, size_t LineSize>
+bool operator!=(const CacheLineIsolatedAllocator<T, BackingAllocator, LineSize> &, const CacheLineIsolatedAllocator<U, BackingAllocator, LineSize> &) {
+    return false;
+}
+} // namespace CacheLineIsolatedAllocator
+} // namespace AllocatorBuilder
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "SharedState.h"
+
+namespace AllocatorBuilder {
+namespace EpochReclaimingAllocator {
+namespace detail {
+// An object handed to retire(), and how to give it back to the allocator it came from
+struct Retired {
+    void * p;
+    size_t n;
+    void (*reclaim)(void * allocator, void * p, size_t n);
+    void * allocator;
+};
+
+template <class BaseAllocator>
+void DestroyAndDeallocate(void * allocator, void * p, size_t n) {
+    using T = typename BaseAllocator::value_type;
+
+    T * objects = reinterpret_cast<T *>(p);
+    for (size_t k = 0; k < n; ++k) {
+        objects[k].~T();
+    }
+    reinterpret_cast<BaseAllocator *>(allocator)->deallocate(objects, n);
+}
+
+// Epoch-based reclamation (Fraser). Threads announce the global epoch while they are inside a read-side section.
+// The global epoch only moves forward once every thread inside a section has seen it, so after two advances no thread
+// can still hold a pointer to something retired before the first. Retired objects wait in one of three per-thread
+// limbo lists, one per epoch modulo 3, and are reclaimed a list at a time.
+//
+// Readers never wait: enter() and leave() are a store each. Writers retire into their own list and only scan the
+// other threads every kBatchSize retirements.
+class EpochDomain {
+public:
+    static const constexpr size_t kBatchSize = 64;
+
+    EpochDomain() : id_(NextDomainId().fetch_add(1, std::memory_order_relaxed)) {}
+
+    EpochDomain(const EpochDomain &) = delete;
+    EpochDomain & operator=(const EpochDomain &) = delete;
+
+    // No thread may be inside a section any more, so everything still retired is reclaimed. Records of threads that
+    // are still running are left for those threads to delete.
+    ~EpochDomain() {
+        ThreadRecord * record = records_.load(std::memory_order_acquire);
+        while (record != nullptr) {
+            ThreadRecord * next = record->next;
+            for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+                reclaimBucket(*record, bucket);
+            }
+            if (record->owner.exchange(kOrphaned, std::memory_order_acq_rel) == kFree) {
+                delete record;
+            }
+            record = next;
+        }
+    }
+
+    // Sections nest, only the outermost enter() and leave() publish anything
+    void enter() {
+        ThreadRecord & record = threadRecord();
+        if (record.nesting++ == 0) {
+            // seq_cst, so the announcement is visible before the section reads any shared pointer
+            record.state.store((global_epoch_.load(std::memory_order_relaxed) << 1) | kActive, std::memory_order_seq_cst);
+        }
+    }
+
+    void leave() {
+        ThreadRecord & record = threadRecord();
+        if (--record.nesting == 0) {
+            record.state.store(0, std::memory_order_release);
+        }
+    }
+
+    // p must already be unreachable for threads that enter a section from now on
+    void retire(const Retired & retired) {
+        ThreadRecord & record = threadRecord();
+
+        uint64_t epoch = global_epoch_.load(std::memory_order_seq_cst);
+        size_t bucket = epoch % kNumBuckets;
+        if (record.limbo_epochs[bucket] != epoch) {
+            // Whatever is left in this list was retired three or more epochs ago
+            reclaimBucket(record, bucket);
+            record.limbo_epochs[bucket] = epoch;
+        }
+        record.limbo[bucket].push_back(retired);
+
+        if (++record.num_retired >= kBatchSize) {
+            record.num_retired = 0;
+            collect(record);
+        }
+    }
+
+    // Tries to advance the epoch far enough to reclaim everything this thread and exited threads retired. Other
+    // threads still inside a section can prevent that, in which case part of it stays retired.
+    void reclaim() {
+        ThreadRecord & own_record = threadRecord();
+        for (size_t k = 0; k < kNumBuckets; ++k) {
+            collect(own_record);
+        }
+
+        for (ThreadRecord * record = records_.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+            uint8_t owner = kFree;
+            if (record->owner.compare_exchange_strong(owner, kOwned, std::memory_order_acquire)) {
+                collect(*record);
+                record->owner.store(kFree, std::memory_order_release);
+            }
+        }
+    }
+
+    // State for the allocators that reclaim into, see EpochReclaimingAllocator
+    SharedState::StateGroup & allocators() {
+        return allocators_;
+    }
+
+private:
+    static const constexpr size_t kNumBuckets = 3;
+    static const constexpr uint64_t kActive = 1;
+
+    // Who a record belongs to. Whichever of the thread and the domain lets go of it last deletes it.
+    static const constexpr uint8_t kFree = 0;     // Owned by the domain, any thread may take it over
+    static const constexpr uint8_t kOwned = 1;    // Owned by a running thread
+    static const constexpr uint8_t kOrphaned = 2; // The domain is gone, owned by a running thread
+
+    struct ThreadRecord {
+        std::atomic<uint64_t> state{0}; // (epoch << 1) | kActive inside a section, 0 outside
+        std::atomic<uint8_t> owner{kOwned};
+        ThreadRecord * next = nullptr;  // Records are never unlinked, only handed to another thread
+
+        // Owner thread only
+        size_t nesting = 0;
+        size_t num_retired = 0;
+        uint64_t limbo_epochs[kNumBuckets] = {};
+        std::vector<Retired> limbo[kNumBuckets];
+    };
+
+    // Hands a record back to its domain, or deletes it if the domain is gone. A dead thread's record keeps its limbo
+    // lists, whoever takes the record over reclaims them.
+    static void releaseRecord(ThreadRecord * record) {
+        record->nesting = 0;
+        record->state.store(0, std::memory_order_release);
+        if (record->owner.exchange(kFree, std::memory_order_acq_rel) == kOrphaned) {
+            delete record;
+        }
+    }
+
+    // The records the calling thread holds, one per domain it has used. Domains are told apart by id rather than
+    // address, since a new domain can be allocated where a destroyed one was. A single thread_local for all domains,
+    // where a pthread key per domain would run out after PTHREAD_KEYS_MAX domains.
+    struct ThreadRecords {
+        struct Entry {
+            uint64_t domain_id;
+            ThreadRecord * record;
+            Entry * next;
+        };
+
+        Entry * head = nullptr;
+        Entry * last_used = nullptr;
+
+        ~ThreadRecords() {
+            while (head != nullptr) {
+                Entry * entry = head;
+                head = entry->next;
+                releaseRecord(entry->record);
+                delete entry;
+            }
+        }
+    };
+
+    static ThreadRecords & threadRecords() {
+        static thread_local ThreadRecords records;
+        return records;
+    }
+
+    static std::atomic<uint64_t> & NextDomainId() {
+        static std::atomic<uint64_t> next_id{1};
+        return next_id;
+    }
+
+    ThreadRecord & threadRecord() {
+        ThreadRecords & records = threadRecords();
+        if (records.last_used != nullptr && records.last_used->domain_id == id_) {
+            return *records.last_used->record;
+        }
+
+        for (ThreadRecords::Entry * entry = records.head; entry != nullptr; entry = entry->next) {
+            if (entry->domain_id == id_) {
+                records.last_used = entry;
+                return *entry->record;
+            }
+        }
+
+        // Drop the records of domains that are gone before adding this one
+        for (ThreadRecords::Entry ** link = &records.head; *link != nullptr;) {
+            ThreadRecords::Entry * entry = *link;
+            if (entry->record->owner.load(std::memory_order_acquire) == kOrphaned) {
+                *link = entry->next;
+                releaseRecord(entry->record);
+                delete entry;
+            } else {
+                link = &entry->next;
+            }
+        }
+
+        ThreadRecords::Entry * entry = new ThreadRecords::Entry{id_, acquireRecord(), records.head};
+        records.head = entry;
+        records.last_used = entry;
+        return *entry->record;
+    }
+
+    ThreadRecord * acquireRecord() {
+        for (ThreadRecord * record = records_.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+            uint8_t owner = kFree;
+            if (record->owner.load(std::memory_order_relaxed) == kFree && record->owner.compare_exchange_strong(owner, kOwned, std::memory_order_acquire)) {
+                return record;
+            }
+        }
+
+        ThreadRecord * record = new ThreadRecord();
+        ThreadRecord * head = records_.load(std::memory_order_relaxed);
+        do {
+            record->next = head;
+        } while (!records_.compare_exchange_weak(head, record, std::memory_order_release, std::memory_order_relaxed));
+        return record;
+    }
+
+    // Moves the global epoch forward if every thread inside a section has already seen it
+    void tryAdvance() {
+        uint64_t epoch = global_epoch_.load(std::memory_order_seq_cst);
+        for (ThreadRecord * record = records_.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+            uint64_t state = record->state.load(std::memory_order_seq_cst);
+            if ((state & kActive) != 0 && (state >> 1) != epoch) {
+                return;
+            }
+        }
+        global_epoch_.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+    }
+
+    void collect(ThreadRecord & record) {
+        tryAdvance();
+
+        uint64_t epoch = global_epoch_.load(std::memory_order_seq_cst);
+        for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+            if (record.limbo_epochs[bucket] + 2 <= epoch) {
+                reclaimBucket(record, bucket);
+            }
+        }
+    }
+
+    static void reclaimBucket(ThreadRecord & record, size_t bucket) {
+        for (const Retired & retired : record.limbo[bucket]) {
+            retired.reclaim(retired.allocator, retired.p, retired.n);
+        }
+        record.limbo[bucket].clear();
+    }
+
+    std::atomic<uint64_t> global_epoch_{0};
+    std::atomic<ThreadRecord *> records_{nullptr};
+    const uint64_t id_;
+
+    SharedState::StateGroup allocators_;
+};
+} // namespace detail
+
+// Deferred reclamation for lock-free data structures, on top of any thread-safe allocator. Readers hold an EpochGuard
+// while they dereference shared nodes; writers unlink a node and retire() it instead of deallocating it. Retired nodes
+// are destroyed and handed back to BaseAllocator in batches, once no guard that could have seen them is left.
+//
+// deallocate() stays immediate, for memory that was never shared. Copies and rebinds share one epoch domain, so a
+// single guard covers every node type of a data structure.
+template <class BaseAllocator>
+class EpochReclaimingAllocator {
+public:
+    // std::allocator_traits
+    using value_type = typename BaseAllocator::value_type;
+    using pointer = value_type*;
+    using const_pointer = const value_type*;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <class U>
+    struct rebind {
+        typedef EpochReclaimingAllocator<typename std::allocator_traits<BaseAllocator>::template rebind_alloc<U>> other;
+    };
+
+    using is_always_equal = std::false_type;
+
+    // custom allocator traits
+    using thread_safe = std::true_type;
+
+    static_assert(BaseAllocator::thread_safe::value, "Base allocator must be thread-safe, retired objects are reclaimed on whichever thread collects them");
+
+    EpochReclaimingAllocator() : EpochReclaimingAllocator(BaseAllocator()) {}
+
+    explicit EpochReclaimingAllocator(const BaseAllocator & allocator)
+        : domain_(std::make_shared<detail::EpochDomain>()), allocator_(&domain_->allocators().template get<BaseAllocator>(allocator)) {}
+
+    template <class OtherBaseAllocator>
+    EpochReclaimingAllocator(const EpochReclaimingAllocator<OtherBaseAllocator> & other)
+        : domain_(other.domain_), allocator_(&domain_->allocators().template get<BaseAllocator>(*other.allocator_)) {}
+
+    pointer address(reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    const_pointer address(const_reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    pointer allocate(std::size_t n, const void * hint) {
+        // purposefully ignore hint
+        return allocate(n);
+    }
+
+    pointer allocate(std::size_t n) {
+        return allocator_->allocate(n);
+    }
+
+    void deallocate(pointer p, std::size_t n) {
+        allocator_->deallocate(p, n);
+    }
+
+    // Destroys the n objects at p and deallocates them once every thread that might still be reading them has left
+    // its section
+    void retire(pointer p, std::size_t n = 1) {
+        domain_->retire(detail::Retired{p, n, &detail::DestroyAndDeallocate<BaseAllocator>, allocator_});
+    }
+
+    void enter() {
+        domain_->enter();
+    }
+
+    void leave() {
+        domain_->leave();
+    }
+
+    // Reclaims whatever this thread retired and is safe to reclaim now, instead of waiting for the next batch
+    void reclaim() {
+        domain_->reclaim();
+    }
+
+    size_type max_size() const noexcept {
+        return std::numeric_limits<size_type>::max() / sizeof(value_type);
+    }
+
+    template <class U, class... Args>
+    void construct(U * p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U>
+    void destroy(U * p) {
+        p->~U();
+    }
+
+    template <class OtherBaseAllocator>
+    bool operator==(const EpochReclaimingAllocator<OtherBaseAllocator> & other) const noexcept {
+        return domain_ == other.domain_;
+    }
+
+    template <class OtherBaseAllocator>
+    bool operator!=(const EpochReclaimingAllocator<OtherBaseAllocator> & other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    template <class OtherBaseAllocator>
+    friend class EpochReclaimingAllocator;
+
+    std::shared_ptr<detail::EpochDomain> domain_;
+    BaseAllocator * allocator_; // Owned by domain_, one per value type
+};
+
+// Read-side section for as long as the guard lives
+template <class Allocator>
+class EpochGuard {
+public:
+    explicit EpochGuard(Allocator & allocator) : allocator_(allocator) {
+        allocator_.enter();
+    }
+
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard & operator=(const EpochGuard &) = delete;
+
+    ~EpochGuard() {
+        allocator_.leave();
+    }
+
+private:
+    Allocator & allocator_;
+};
+} // namespace EpochReclaimingAllocator
+} // namespace AllocatorBuilder
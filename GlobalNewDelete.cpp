@@ -0,0 +1,148 @@
+// Opt-in replacement of every global operator new and delete with a ThreadCachedHeap. Link this translation unit
+// into a program (the allocatorbuilder_newdelete object library) and all new expressions use it, containers included.
+//
+// Sized delete (on by default since C++14) hands back the size the object was allocated with, so the size class is
+// computed directly and no page map lookup or header is needed. Only unsized delete pays for the lookup.
+//
+// The aligned forms need std::align_val_t, which GCC and Clang provide in C++14 mode with -faligned-new.
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <new>
+
+#include "ThreadCachedHeap.h"
+
+using namespace AllocatorBuilder;
+
+namespace {
+struct NewDeleteTag {};
+using Heap = ThreadCachedHeap::ThreadCachedHeap<NewDeleteTag>;
+
+#ifdef __STDCPP_DEFAULT_NEW_ALIGNMENT__
+constexpr size_t kDefaultAlignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+#else
+constexpr size_t kDefaultAlignment = alignof(std::max_align_t);
+#endif
+
+void * AllocateOrThrow(size_t size, size_t alignment) {
+    for (;;) {
+        void * p = Heap::allocate(size, alignment);
+        if (p != nullptr) {
+            return p;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void * AllocateOrNull(size_t size, size_t alignment) noexcept {
+    try {
+        return AllocateOrThrow(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void Deallocate(void * p) noexcept {
+    if (p != nullptr) {
+        Heap::deallocate(p);
+    }
+}
+
+void Deallocate(void * p, size_t size, size_t alignment) noexcept {
+    if (p != nullptr) {
+        Heap::deallocate(p, size, alignment);
+    }
+}
+
+__attribute__((constructor)) void RegisterForkHandlers() {
+    pthread_atfork(Heap::lockForFork, Heap::unlockAfterFork, Heap::unlockAfterFork);
+}
+} // namespace
+
+void * operator new(size_t size) {
+    return AllocateOrThrow(size, kDefaultAlignment);
+}
+
+void * operator new[](size_t size) {
+    return AllocateOrThrow(size, kDefaultAlignment);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept {
+    return AllocateOrNull(size, kDefaultAlignment);
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return AllocateOrNull(size, kDefaultAlignment);
+}
+
+void operator delete(void * p) noexcept {
+    Deallocate(p);
+}
+
+void operator delete[](void * p) noexcept {
+    Deallocate(p);
+}
+
+void operator delete(void * p, const std::nothrow_t &) noexcept {
+    Deallocate(p);
+}
+
+void operator delete[](void * p, const std::nothrow_t &) noexcept {
+    Deallocate(p);
+}
+
+void operator delete(void * p, size_t size) noexcept {
+    Deallocate(p, size, kDefaultAlignment);
+}
+
+void operator delete[](void * p, size_t size) noexcept {
+    Deallocate(p, size, kDefaultAlignment);
+}
+
+#if __cpp_aligned_new
+void * operator new(size_t size, std::align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void * operator new[](size_t size, std::align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void * operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return AllocateOrNull(size, static_cast<size_t>(alignment));
+}
+
+void * operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return AllocateOrNull(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void * p, std::align_val_t) noexcept {
+    Deallocate(p);
+}
+
+void operator delete[](void * p, std::align_val_t) noexcept {
+    Deallocate(p);
+}
+
+void operator delete(void * p, std::align_val_t, const std::nothrow_t &) noexcept {
+    Deallocate(p);
+}
+
+void operator delete[](void * p, std::align_val_t, const std::nothrow_t &) noexcept {
+    Deallocate(p);
+}
+
+void operator delete(void * p, size_t size, std::align_val_t alignment) noexcept {
+    Deallocate(p, size, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void * p, size_t size, std::align_val_t alignment) noexcept {
+    Deallocate(p, size, static_cast<size_t>(alignment));
+}
+#endif
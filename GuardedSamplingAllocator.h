@@ -0,0 +1,555 @@
+#pragma once
+
+#include <execinfo.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+#include "PageHeap.h"
+
+namespace AllocatorBuilder {
+namespace GuardedSamplingAllocator {
+struct Options {
+    size_t sample_rate = 5000; // On average one allocation in sample_rate is guarded, 0 turns sampling off
+    size_t num_slots = 128;    // Guarded allocations that can be live or quarantined at once, two pages of address space each
+};
+
+namespace detail {
+static const constexpr size_t kMaxStackDepth = 32;
+
+// Metadata of one guarded page, kept outside the page so it survives the page being protected
+struct Slot {
+    enum class State : uint8_t {
+        kUnused,
+        kAllocated,
+        kFreed
+    };
+
+    State state;
+    char * object;
+    size_t size;
+
+    pid_t allocation_thread;
+    int allocation_stack_depth;
+    void * allocation_stack[kMaxStackDepth];
+
+    pid_t deallocation_thread;
+    int deallocation_stack_depth;
+    void * deallocation_stack[kMaxStackDepth];
+};
+
+// Process-wide pool of guarded pages, laid out as guard, slot, guard, slot, ..., guard. Every guard page and every
+// unused or freed slot is PROT_NONE, so overflowing an object (which is placed at the end of its page), underflowing
+// it or touching it after free faults, and the SIGSEGV handler reports the slot's allocation and deallocation stacks.
+// Freed slots are reused oldest first, which keeps them protected for as long as possible.
+//
+// Everything on the sampling path is rare and takes a mutex. The only per-allocation cost is shouldSample().
+template <class Unused = void>
+class GuardedPoolImpl {
+public:
+    // Only allowed until the pool is set up by the first sampled allocation, later calls change nothing and return
+    // false
+    static bool configure(const Options & options) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (initialized_) {
+            return false;
+        }
+        options_ = options;
+        sample_rate_.store(options.sample_rate, std::memory_order_relaxed);
+        return true;
+    }
+
+    static bool shouldSample() {
+        return --sample_counter_ == 0;
+    }
+
+    // Called once shouldSample() said so. Picks the next sample and returns a guarded allocation, or nullptr if this
+    // one cannot be guarded after all (too large, pool full, first call on this thread) and the caller has to fall back.
+    static void * allocate(size_t size, size_t alignment) {
+        bool seeded = thread_seeded_;
+        thread_seeded_ = true;
+        sample_counter_ = NextSampleInterval();
+        if (!seeded) {
+            // Skip the very first allocation of each thread, which would otherwise always be sampled
+            return nullptr;
+        }
+        if (sample_rate_.load(std::memory_order_relaxed) == 0) {
+            // Sampling is off, the counter only ran out after 2^32 allocations. Never set the pool up for it.
+            return nullptr;
+        }
+
+        std::call_once(init_flag_, Init);
+        if (region_end_.load(std::memory_order_acquire) == 0 || size == 0 || size > page_size_ || alignment > page_size_) {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t index;
+        if (!TakeSlot(index)) {
+            return nullptr;
+        }
+
+        char * page = SlotPage(index);
+        if (mprotect(page, page_size_, PROT_READ | PROT_WRITE) != 0) {
+            PushQuarantine(index);
+            return nullptr;
+        }
+
+        Slot & slot = slots_[index];
+        slot.state = Slot::State::kAllocated;
+        slot.object = page + page_size_ - PageHeap::RoundUp(size, alignment);
+        slot.size = size;
+        slot.allocation_thread = CurrentThread();
+        slot.allocation_stack_depth = backtrace(slot.allocation_stack, kMaxStackDepth);
+        slot.deallocation_thread = 0;
+        slot.deallocation_stack_depth = 0;
+
+        ++num_guarded_allocations_;
+        return slot.object;
+    }
+
+    static bool owns(const void * p) {
+        // region_end_ is published last, so once it is set region_begin_ is too
+        uintptr_t address = reinterpret_cast<uintptr_t>(p);
+        return address < region_end_.load(std::memory_order_acquire) && address >= region_begin_.load(std::memory_order_relaxed);
+    }
+
+    // p must be owned by the pool. Double and invalid frees are reported and abort.
+    static void deallocate(void * p) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        uintptr_t address = reinterpret_cast<uintptr_t>(p);
+        size_t page_index = (address - region_begin_.load(std::memory_order_relaxed)) / page_size_;
+        if (page_index % 2 == 0) {
+            ReportAndAbort("invalid free", address);
+        }
+
+        size_t index = page_index / 2;
+        Slot & slot = slots_[index];
+        if (slot.state == Slot::State::kFreed) {
+            ReportAndAbort("double free", address);
+        } else if (slot.state != Slot::State::kAllocated || slot.object != p) {
+            ReportAndAbort("invalid free", address);
+        }
+
+        slot.state = Slot::State::kFreed;
+        slot.deallocation_thread = CurrentThread();
+        slot.deallocation_stack_depth = backtrace(slot.deallocation_stack, kMaxStackDepth);
+
+        char * page = SlotPage(index);
+        mprotect(page, page_size_, PROT_NONE);
+        madvise(page, page_size_, MADV_DONTNEED);
+        PushQuarantine(index);
+    }
+
+    static size_t numGuardedAllocations() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return num_guarded_allocations_;
+    }
+
+private:
+    static void Init() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            initialized_ = true;
+            num_slots_ = options_.num_slots;
+        }
+
+        page_size_ = sysconf(_SC_PAGESIZE);
+        if (num_slots_ == 0) {
+            return;
+        }
+
+        size_t region_size = (2 * num_slots_ + 1) * page_size_;
+        void * region = mmap(nullptr, region_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            return;
+        }
+
+        slots_ = reinterpret_cast<Slot *>(PageHeap::MapPages(num_slots_ * sizeof(Slot), PageHeap::kPageSize));
+        quarantine_ = reinterpret_cast<size_t *>(PageHeap::MapPages(num_slots_ * sizeof(size_t), PageHeap::kPageSize));
+        if (slots_ == nullptr || quarantine_ == nullptr) {
+            munmap(region, region_size);
+            return;
+        }
+
+        // backtrace() loads the unwinder the first time it runs, which must not happen inside the signal handler
+        void * unused[1];
+        backtrace(unused, 1);
+
+        struct sigaction action = {};
+        action.sa_sigaction = HandleSignal;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_action_);
+
+        region_begin_.store(reinterpret_cast<uintptr_t>(region), std::memory_order_relaxed);
+        region_end_.store(reinterpret_cast<uintptr_t>(region) + region_size, std::memory_order_release);
+    }
+
+    static uint32_t NextSampleInterval() {
+        size_t sample_rate = sample_rate_.load(std::memory_order_relaxed);
+        if (sample_rate == 0) {
+            return std::numeric_limits<uint32_t>::max();
+        }
+
+        // xorshift, seeded per thread; uniform in [1, 2 * sample_rate - 1] so the mean is sample_rate
+        if (random_state_ == 0) {
+            random_state_ = (static_cast<uint32_t>(CurrentThread()) * 2654435761u ^ static_cast<uint32_t>(time(nullptr))) | 1;
+        }
+        random_state_ ^= random_state_ << 13;
+        random_state_ ^= random_state_ >> 17;
+        random_state_ ^= random_state_ << 5;
+
+        uint32_t range = static_cast<uint32_t>(std::min<size_t>(2 * sample_rate - 1, std::numeric_limits<uint32_t>::max() - 1));
+        return 1 + random_state_ % range;
+    }
+
+    static pid_t CurrentThread() {
+        return static_cast<pid_t>(syscall(SYS_gettid));
+    }
+
+    static char * SlotPage(size_t index) {
+        return reinterpret_cast<char *>(region_begin_.load(std::memory_order_relaxed)) + (2 * index + 1) * page_size_;
+    }
+
+    // Never used slots first, then the one freed longest ago
+    static bool TakeSlot(size_t & index) {
+        if (next_unused_slot_ < num_slots_) {
+            index = next_unused_slot_++;
+            return true;
+        } else if (quarantine_size_ != 0) {
+            index = quarantine_[quarantine_head_];
+            quarantine_head_ = (quarantine_head_ + 1) % num_slots_;
+            --quarantine_size_;
+            return true;
+        }
+        return false;
+    }
+
+    static void PushQuarantine(size_t index) {
+        quarantine_[(quarantine_head_ + quarantine_size_) % num_slots_] = index;
+        ++quarantine_size_;
+    }
+
+    // The slot a faulting address belongs to: its own slot for a slot page, the closest used neighbour for a guard page
+    static const Slot * SlotFor(uintptr_t address, const char * & error) {
+        size_t page_index = (address - region_begin_.load(std::memory_order_relaxed)) / page_size_;
+        if (page_index % 2 == 1) {
+            const Slot * slot = &slots_[page_index / 2];
+            error = slot->state == Slot::State::kFreed ? "use-after-free" : "unknown access";
+            return slot;
+        }
+
+        const Slot * left = page_index > 0 ? &slots_[page_index / 2 - 1] : nullptr;
+        const Slot * right = page_index / 2 < num_slots_ ? &slots_[page_index / 2] : nullptr;
+        if (left != nullptr && left->state == Slot::State::kUnused) {
+            left = nullptr;
+        }
+        if (right != nullptr && right->state == Slot::State::kUnused) {
+            right = nullptr;
+        }
+
+        if (left != nullptr && (right == nullptr || address - reinterpret_cast<uintptr_t>(left->object + left->size) <= reinterpret_cast<uintptr_t>(right->object) - address)) {
+            error = "buffer overflow";
+            return left;
+        } else if (right != nullptr) {
+            error = "buffer underflow";
+            return right;
+        }
+
+        error = "wild access";
+        return nullptr;
+    }
+
+    // Formats into a stack buffer and write()s it, so it is usable from the signal handler
+    static void Print(const char * format, ...) {
+        char line[256];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+
+        const char * data = line;
+        size_t remaining = std::min(static_cast<size_t>(std::max(length, 0)), sizeof(line) - 1);
+        while (remaining > 0) {
+            ssize_t written = write(STDERR_FILENO, data, remaining);
+            if (written <= 0) {
+                return;
+            }
+            data += written;
+            remaining -= written;
+        }
+    }
+
+    static void Report(const char * error, uintptr_t address, const Slot * slot) {
+        Print("*** GuardedSamplingAllocator: %s at 0x%zx\n", error, static_cast<size_t>(address));
+        if (slot == nullptr || slot->state == Slot::State::kUnused) {
+            return;
+        }
+
+        uintptr_t object = reinterpret_cast<uintptr_t>(slot->object);
+        if (address < object) {
+            Print("0x%zx is %zu bytes before", static_cast<size_t>(address), static_cast<size_t>(object - address));
+        } else if (address >= object + slot->size) {
+            Print("0x%zx is %zu bytes after", static_cast<size_t>(address), static_cast<size_t>(address - object - slot->size));
+        } else {
+            Print("0x%zx is %zu bytes into", static_cast<size_t>(address), static_cast<size_t>(address - object));
+        }
+        Print(" a %zu byte allocation at 0x%zx\n", slot->size, static_cast<size_t>(object));
+
+        Print("allocated by thread %d:\n", static_cast<int>(slot->allocation_thread));
+        backtrace_symbols_fd(slot->allocation_stack, slot->allocation_stack_depth, STDERR_FILENO);
+
+        if (slot->state == Slot::State::kFreed) {
+            Print("freed by thread %d:\n", static_cast<int>(slot->deallocation_thread));
+            backtrace_symbols_fd(slot->deallocation_stack, slot->deallocation_stack_depth, STDERR_FILENO);
+        }
+    }
+
+    static void ReportAndAbort(const char * error, uintptr_t address) {
+        const char * unused;
+        const Slot * slot = SlotFor(address, unused);
+        Report(error, address, slot);
+
+        Print("detected here:\n");
+        void * stack[kMaxStackDepth];
+        backtrace_symbols_fd(stack, backtrace(stack, kMaxStackDepth), STDERR_FILENO);
+        abort();
+    }
+
+    static void HandleSignal(int signal_number, siginfo_t * info, void * context) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+        if (owns(info->si_addr)) {
+            const char * error;
+            const Slot * slot = SlotFor(address, error);
+            Report(error, address, slot);
+
+            // A memory error is fatal: give the fault back to whoever had it before, the access runs again and faults
+            // into the previous handler (by default a core dump)
+            sigaction(SIGSEGV, &previous_action_, nullptr);
+            return;
+        }
+
+        // Not ours, chain to the previous handler and stay installed. A default or ignored disposition can only be
+        // had by restoring it, and it ends the process anyway.
+        if ((previous_action_.sa_flags & SA_SIGINFO) != 0) {
+            previous_action_.sa_sigaction(signal_number, info, context);
+        } else if (previous_action_.sa_handler != SIG_DFL && previous_action_.sa_handler != SIG_IGN) {
+            previous_action_.sa_handler(signal_number);
+        } else {
+            sigaction(SIGSEGV, &previous_action_, nullptr);
+        }
+    }
+
+    static Options options_;
+    static std::atomic<size_t> sample_rate_;
+    static std::once_flag init_flag_;
+    static std::mutex mutex_;
+    static bool initialized_; // Under mutex_, set once Init() has read options_
+
+    static size_t page_size_;
+    static std::atomic<uintptr_t> region_begin_;
+    static std::atomic<uintptr_t> region_end_;
+    static struct sigaction previous_action_;
+
+    static Slot * slots_;
+    static size_t num_slots_;
+    static size_t next_unused_slot_;
+    static size_t * quarantine_; // Ring of freed slots, oldest at quarantine_head_
+    static size_t quarantine_head_;
+    static size_t quarantine_size_;
+    static size_t num_guarded_allocations_;
+
+    // Constant-initialized, so reading them costs no TLS wrapper call
+    static thread_local uint32_t sample_counter_;
+    static thread_local uint32_t random_state_;
+    static thread_local bool thread_seeded_;
+};
+
+template <class Unused>
+Options GuardedPoolImpl<Unused>::options_;
+
+template <class Unused>
+std::atomic<size_t> GuardedPoolImpl<Unused>::sample_rate_(Options().sample_rate);
+
+template <class Unused>
+std::once_flag GuardedPoolImpl<Unused>::init_flag_;
+
+template <class Unused>
+std::mutex GuardedPoolImpl<Unused>::mutex_;
+
+template <class Unused>
+bool GuardedPoolImpl<Unused>::initialized_ = false;
+
+template <class Unused>
+size_t GuardedPoolImpl<Unused>::page_size_ = 0;
+
+template <class Unused>
+std::atomic<uintptr_t> GuardedPoolImpl<Unused>::region_begin_(0);
+
+template <class Unused>
+std::atomic<uintptr_t> GuardedPoolImpl<Unused>::region_end_(0);
+
+template <class Unused>
+struct sigaction GuardedPoolImpl<Unused>::previous_action_;
+
+template <class Unused>
+Slot * GuardedPoolImpl<Unused>::slots_ = nullptr;
+
+template <class Unused>
+size_t GuardedPoolImpl<Unused>::num_slots_ = 0;
+
+template <class Unused>
+size_t GuardedPoolImpl<Unused>::next_unused_slot_ = 0;
+
+template <class Unused>
+size_t * GuardedPoolImpl<Unused>::quarantine_ = nullptr;
+
+template <class Unused>
+size_t GuardedPoolImpl<Unused>::quarantine_head_ = 0;
+
+template <class Unused>
+size_t GuardedPoolImpl<Unused>::quarantine_size_ = 0;
+
+template <class Unused>
+size_t GuardedPoolImpl<Unused>::num_guarded_allocations_ = 0;
+
+template <class Unused>
+thread_local uint32_t GuardedPoolImpl<Unused>::sample_counter_ = 1;
+
+template <class Unused>
+thread_local uint32_t GuardedPoolImpl<Unused>::random_state_ = 0;
+
+template <class Unused>
+thread_local bool GuardedPoolImpl<Unused>::thread_seeded_ = false;
+
+using GuardedPool = GuardedPoolImpl<>;
+} // namespace detail
+
+// Sampling rate and pool size for every GuardedSamplingAllocator in the process. Call before the first allocation;
+// returns false and changes nothing once a sampled allocation has set up the pool.
+inline bool Configure(const Options & options) {
+    return detail::GuardedPool::configure(options);
+}
+
+inline size_t NumGuardedAllocations() {
+    return detail::GuardedPool::numGuardedAllocations();
+}
+
+// Catches use-after-free and out-of-bounds accesses in production, GWP-ASan style: a random sample of allocations up
+// to a page in size is served from detail::GuardedPool instead of BaseAllocator, and a fault on one of those prints
+// where the object was allocated and freed. Everything else goes straight to BaseAllocator, after decrementing a
+// thread-local counter.
+template <class BaseAllocator>
+class GuardedSamplingAllocator {
+public:
+    // std::allocator_traits
+    using value_type = typename BaseAllocator::value_type;
+    using pointer = value_type*;
+    using const_pointer = const value_type*;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = typename std::allocator_traits<BaseAllocator>::propagate_on_container_copy_assignment;
+    using propagate_on_container_move_assignment = typename std::allocator_traits<BaseAllocator>::propagate_on_container_move_assignment;
+    using propagate_on_container_swap = typename std::allocator_traits<BaseAllocator>::propagate_on_container_swap;
+
+    template <class U>
+    struct rebind {
+        typedef GuardedSamplingAllocator<typename std::allocator_traits<BaseAllocator>::template rebind_alloc<U>> other;
+    };
+
+    // The pool is process-wide, so equality is the base allocator's
+    using is_always_equal = typename std::allocator_traits<BaseAllocator>::is_always_equal;
+
+    // custom allocator traits
+    using thread_safe = typename BaseAllocator::thread_safe;
+
+    GuardedSamplingAllocator() = default;
+
+    explicit GuardedSamplingAllocator(const BaseAllocator & allocator) : allocator_(allocator) {}
+
+    template <class OtherBaseAllocator>
+    GuardedSamplingAllocator(const GuardedSamplingAllocator<OtherBaseAllocator> & other) : allocator_(other.allocator_) {}
+
+    pointer address(reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    const_pointer address(const_reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    pointer allocate(std::size_t n, const void * hint) {
+        // purposefully ignore hint
+        return allocate(n);
+    }
+
+    pointer allocate(std::size_t n) {
+        if (detail::GuardedPool::shouldSample() && n <= max_size()) {
+            void * mem = detail::GuardedPool::allocate(n * sizeof(value_type), alignof(value_type));
+            if (mem != nullptr) {
+                return reinterpret_cast<pointer>(mem);
+            }
+        }
+        return allocator_.allocate(n);
+    }
+
+    void deallocate(pointer p, std::size_t n) {
+        if (detail::GuardedPool::owns(p)) {
+            detail::GuardedPool::deallocate(p);
+            return;
+        }
+        allocator_.deallocate(p, n);
+    }
+
+    size_type max_size() const noexcept {
+        return std::numeric_limits<size_type>::max() / sizeof(value_type);
+    }
+
+    template <class U, class... Args>
+    void construct(U * p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U>
+    void destroy(U * p) {
+        p->~U();
+    }
+
+    template <class OtherBaseAllocator>
+    bool operator==(const GuardedSamplingAllocator<OtherBaseAllocator> & other) const noexcept {
+        return allocator_ == other.allocator_;
+    }
+
+    template <class OtherBaseAllocator>
+    bool operator!=(const GuardedSamplingAllocator<OtherBaseAllocator> & other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    template <class OtherBaseAllocator>
+    friend class GuardedSamplingAllocator;
+
+    BaseAllocator allocator_;
+};
+} // namespace GuardedSamplingAllocator
+} // namespace AllocatorBuilder
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <ostream>
+
+namespace AllocatorBuilder {
+namespace HeapIntrospection {
+// Slabs bucketed by how many of their slots are handed out: empty, (0, 25%), [25%, 50%), [50%, 75%), [75%, 100%), full
+struct SlabOccupancyHistogram {
+    static const constexpr size_t kNumBuckets = 6;
+
+    size_t slabs[kNumBuckets] = {};
+
+    static size_t BucketFor(size_t used, size_t capacity) {
+        if (used == 0) {
+            return 0;
+        } else if (used == capacity) {
+            return kNumBuckets - 1;
+        }
+        return 1 + used * 4 / capacity;
+    }
+
+    void add(size_t used, size_t capacity, size_t num_slabs = 1) {
+        slabs[BucketFor(used, capacity)] += num_slabs;
+    }
+};
+
+struct SlabHeapStats {
+    size_t num_slabs = 0;
+    size_t slab_bytes = 0;      // Everything obtained from the backing memory
+    size_t slot_bytes = 0;      // Part of slab_bytes that can hold objects, the rest is headers and tails
+    size_t live_bytes = 0;      // Slots currently handed out
+    size_t requested_bytes = 0; // What callers asked for, <= live_bytes because of size class rounding
+
+    SlabOccupancyHistogram occupancy;
+
+    // Lost to slab headers and tails that are too small for another slot
+    double overheadRatio() const {
+        return slab_bytes == 0 ? 0.0 : 1.0 - double(slot_bytes) / slab_bytes;
+    }
+
+    // Lost inside handed out slots to rounding up to the slot size
+    double internalFragmentation() const {
+        return live_bytes == 0 ? 0.0 : 1.0 - double(requested_bytes) / live_bytes;
+    }
+
+    // Slots held in slabs but not handed out
+    double externalFragmentation() const {
+        return slot_bytes == 0 ? 0.0 : 1.0 - double(live_bytes) / slot_bytes;
+    }
+};
+
+struct BuddyHeapStats {
+    static const constexpr size_t kMaxOrders = sizeof(size_t) * 8;
+
+    size_t total_bytes = 0;
+    size_t free_bytes = 0;
+    size_t requested_bytes = 0;
+    size_t largest_free_block = 0;
+
+    // free_blocks[k] is the number of free blocks of 2^k bytes
+    size_t free_blocks[kMaxOrders] = {};
+
+    size_t allocatedBytes() const {
+        return total_bytes - free_bytes;
+    }
+
+    // Lost to rounding requests up to a power of 2
+    double internalFragmentation() const {
+        return allocatedBytes() == 0 ? 0.0 : 1.0 - double(requested_bytes) / allocatedBytes();
+    }
+
+    // 0 when all free memory is one block, close to 1 when it is scattered in small blocks. A failed allocation with
+    // high external fragmentation means the heap is fragmented rather than full.
+    double externalFragmentation() const {
+        return free_bytes == 0 ? 0.0 : 1.0 - double(largest_free_block) / free_bytes;
+    }
+};
+
+// Heap maps print one glyph per slab or block: '.' for empty, '1'..'9' for tenths used, '#' for full
+inline char OccupancyGlyph(size_t used, size_t capacity) {
+    if (used == 0) {
+        return '.';
+    } else if (used >= capacity) {
+        return '#';
+    }
+
+    size_t tenths = used * 10 / capacity;
+    return static_cast<char>('0' + (tenths == 0 ? 1 : tenths));
+}
+
+inline std::ostream & operator<<(std::ostream & os, const SlabHeapStats & stats) {
+    os << "slabs=" << stats.num_slabs << " slab_bytes=" << stats.slab_bytes << " live_bytes=" << stats.live_bytes
+       << " requested_bytes=" << stats.requested_bytes << " overhead=" << stats.overheadRatio()
+       << " internal=" << stats.internalFragmentation() << " external=" << stats.externalFragmentation() << " occupancy=[";
+    for (size_t bucket = 0; bucket < SlabOccupancyHistogram::kNumBuckets; ++bucket) {
+        os << (bucket == 0 ? "" : " ") << stats.occupancy.slabs[bucket];
+    }
+    return os << "]";
+}
+
+inline std::ostream & operator<<(std::ostream & os, const BuddyHeapStats & stats) {
+    os << "total_bytes=" << stats.total_bytes << " free_bytes=" << stats.free_bytes << " largest_free_block="
+       << stats.largest_free_block << " internal=" << stats.internalFragmentation() << " external="
+       << stats.externalFragmentation() << " free_blocks={";
+    bool first = true;
+    for (size_t order = 0; order < BuddyHeapStats::kMaxOrders; ++order) {
+        if (stats.free_blocks[order] != 0) {
+            os << (first ? "" : " ") << (size_t(1) << order) << ":" << stats.free_blocks[order];
+            first = false;
+        }
+    }
+    return os << "}";
+}
+} // namespace HeapIntrospection
+} // namespace AllocatorBuilder
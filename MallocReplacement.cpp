@@ -0,0 +1,127 @@
+// malloc replacement assembled from the builder's components (see ThreadCachedHeap.h), meant for LD_PRELOAD:
+//
+//     LD_PRELOAD=./liballocatorbuilder_malloc.so ./some_binary
+//
+// Nothing here forwards to the libc allocator, so there is no dlsym() lookup to bootstrap.
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstddef>
+
+#include "PageHeap.h"
+#include "ThreadCachedHeap.h"
+
+#define ALLOCATOR_BUILDER_EXPORT extern "C" __attribute__((visibility("default")))
+
+using namespace AllocatorBuilder;
+
+namespace {
+struct MallocTag {};
+using Heap = ThreadCachedHeap::ThreadCachedHeap<MallocTag>;
+
+void * Allocate(size_t size, size_t alignment) {
+    void * p = Heap::allocate(size, alignment);
+    if (p == nullptr) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+bool IsValidAlignment(size_t alignment) {
+    return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
+
+// pthread_atfork allocates, so it cannot be called from inside the allocator
+__attribute__((constructor)) void RegisterForkHandlers() {
+    pthread_atfork(Heap::lockForFork, Heap::unlockAfterFork, Heap::unlockAfterFork);
+}
+} // namespace
+
+ALLOCATOR_BUILDER_EXPORT void * malloc(size_t size) noexcept {
+    return Allocate(size, alignof(std::max_align_t));
+}
+
+ALLOCATOR_BUILDER_EXPORT void free(void * p) noexcept {
+    if (p != nullptr) {
+        Heap::deallocate(p);
+    }
+}
+
+ALLOCATOR_BUILDER_EXPORT size_t malloc_usable_size(void * p) noexcept {
+    return p == nullptr ? 0 : Heap::usableSize(p);
+}
+
+ALLOCATOR_BUILDER_EXPORT void * calloc(size_t count, size_t size) noexcept {
+    size_t bytes;
+    if (__builtin_mul_overflow(count, size, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    void * p = malloc(bytes);
+    if (p != nullptr && Heap::mayBeDirty(p)) {
+        memset(p, 0, bytes);
+    }
+    return p;
+}
+
+ALLOCATOR_BUILDER_EXPORT void * realloc(void * p, size_t size) noexcept {
+    if (p == nullptr) {
+        return malloc(size);
+    } else if (size == 0) {
+        free(p);
+        return nullptr;
+    }
+
+    size_t usable_size = malloc_usable_size(p);
+    if (size <= usable_size && size >= usable_size / 2) {
+        return p;
+    }
+
+    void * new_p = malloc(size);
+    if (new_p != nullptr) {
+        memcpy(new_p, p, std::min(size, usable_size));
+        free(p);
+    }
+    return new_p;
+}
+
+ALLOCATOR_BUILDER_EXPORT int posix_memalign(void ** memptr, size_t alignment, size_t size) noexcept {
+    if (!IsValidAlignment(alignment) || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+
+    void * p = Heap::allocate(size, alignment);
+    if (p == nullptr) {
+        return ENOMEM;
+    }
+
+    *memptr = p;
+    return 0;
+}
+
+ALLOCATOR_BUILDER_EXPORT void * aligned_alloc(size_t alignment, size_t size) noexcept {
+    if (!IsValidAlignment(alignment)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return Allocate(size, alignment);
+}
+
+// The legacy entry points have to be replaced as well, or memory from the libc heap would end up in our free()
+ALLOCATOR_BUILDER_EXPORT void * memalign(size_t alignment, size_t size) noexcept {
+    return aligned_alloc(alignment, size);
+}
+
+ALLOCATOR_BUILDER_EXPORT void * valloc(size_t size) noexcept {
+    return Allocate(size, PageHeap::kPageSize);
+}
+
+ALLOCATOR_BUILDER_EXPORT void * pvalloc(size_t size) noexcept {
+    return Allocate(PageHeap::RoundUp(size, PageHeap::kPageSize), PageHeap::kPageSize);
+}
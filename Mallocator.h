@@ -2,9 +2,12 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <new>
+#include <stdexcept>
 #include <type_traits>
 
 namespace AllocatorBuilder {
@@ -32,6 +35,11 @@ public:
     // custom allocator traits
     using thread_safe = std::true_type;
 
+    Mallocator() = default;
+
+    template <class U>
+    Mallocator(const Mallocator<U> &) noexcept {}
+
     pointer address(reference x) const noexcept {
         return std::addressof(x);
     }
@@ -79,5 +87,15 @@ public:
         p->~U();
     }
 };
+
+template <class T, class U>
+bool operator==(const Mallocator<T> &, const Mallocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const Mallocator<T> &, const Mallocator<U> &) noexcept {
+    return false;
+}
 } // namespace Mallocator
 } // namespace AllocatorBuilder
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <mutex>
+
+namespace AllocatorBuilder {
+namespace PageHeap {
+// Memory straight from the kernel, for components that cannot call back into malloc (see MallocReplacement.cpp).
+constexpr size_t kPageSize = 4096;
+
+// Large allocations carry a header of this many bytes right before the returned pointer
+constexpr size_t kLargeHeaderSize = 64;
+
+constexpr size_t RoundUp(size_t n, size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+// Returns size bytes of zeroed memory aligned to alignment (a power of 2), or nullptr
+inline void * MapPages(size_t size, size_t alignment) {
+    size = RoundUp(size, kPageSize);
+    alignment = std::max(alignment, kPageSize);
+
+    size_t mapping_size = alignment == kPageSize ? size : size + alignment;
+    if (mapping_size < size) {
+        return nullptr;
+    }
+
+    void * mem = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // Trim the misaligned head and the tail of an over-sized mapping
+    char * base = reinterpret_cast<char *>(mem);
+    char * aligned = reinterpret_cast<char *>(RoundUp(reinterpret_cast<uintptr_t>(base), alignment));
+    if (aligned != base) {
+        munmap(base, aligned - base);
+    }
+
+    char * end = base + mapping_size;
+    if (aligned + size != end) {
+        munmap(aligned + size, end - (aligned + size));
+    }
+
+    return aligned;
+}
+
+inline void UnmapPages(void * mem, size_t size) {
+    munmap(mem, RoundUp(size, kPageSize));
+}
+
+// Two level radix tree from page address to a byte of metadata, 0 for pages it knows nothing about. Leaves are mapped
+// on first use. set() must be serialized by the caller; get() is lock-free and may race with set() on other pages.
+class PageMap {
+public:
+    uint8_t get(const void * p) const {
+        uintptr_t page = reinterpret_cast<uintptr_t>(p) / kPageSize;
+        uint8_t * leaf = leaves_[page >> kLeafBits].load(std::memory_order_acquire);
+        return leaf == nullptr ? 0 : leaf[page & (kLeafSize - 1)];
+    }
+
+    bool set(const void * p, size_t size, uint8_t value) {
+        uintptr_t first_page = reinterpret_cast<uintptr_t>(p) / kPageSize;
+        uintptr_t last_page = (reinterpret_cast<uintptr_t>(p) + size - 1) / kPageSize;
+        assert((last_page >> kLeafBits) < kNumLeaves); // Only 48 bit addresses are supported
+
+        for (uintptr_t page = first_page; page <= last_page; ++page) {
+            std::atomic<uint8_t *> & slot = leaves_[page >> kLeafBits];
+            uint8_t * leaf = slot.load(std::memory_order_relaxed);
+            if (leaf == nullptr) {
+                leaf = reinterpret_cast<uint8_t *>(MapPages(kLeafSize, kPageSize));
+                if (leaf == nullptr) {
+                    return false;
+                }
+                slot.store(leaf, std::memory_order_release);
+            }
+            leaf[page & (kLeafSize - 1)] = value;
+        }
+
+        return true;
+    }
+
+private:
+    static const constexpr size_t kAddressBits = 48;
+    static const constexpr size_t kPageBits = 12;
+    static const constexpr size_t kLeafBits = 18;
+    static const constexpr size_t kLeafSize = size_t(1) << kLeafBits;
+    static const constexpr size_t kNumLeaves = size_t(1) << (kAddressBits - kPageBits - kLeafBits);
+
+    static_assert(size_t(1) << kPageBits == kPageSize, "kPageBits does not match kPageSize");
+
+    std::atomic<uint8_t *> leaves_[kNumLeaves];
+};
+
+// SizeClassAllocator::detail::SizeClassHeap slab source that records each slab's size class (plus one) in Map, so a
+// bare pointer can be traced back to its size class. Slabs are carved out of kChunkSize mappings, one chunk at a time
+// per slab size, and released slabs are kept on a free list per slab size instead of being unmapped: a mapping and a
+// page fault per slab costs more than the slab is worth. Calls must be serialized, like the heap itself.
+template <PageMap & Map>
+class SlabSource {
+public:
+    static const constexpr size_t kChunkSize = 1024 * 1024;
+
+    static void * allocateSlab(size_t slab_size, size_t size_class) {
+        assert(slab_size >= kPageSize && slab_size <= kChunkSize && (slab_size & (slab_size - 1)) == 0);
+        SlabSizeState & state = states_[SlabSizeIndex(slab_size)];
+
+        void * mem;
+        if (state.free_slabs != nullptr) {
+            mem = state.free_slabs;
+            state.free_slabs = state.free_slabs->next;
+        } else {
+            if (state.bump == state.end) {
+                char * chunk = reinterpret_cast<char *>(MapPages(kChunkSize, slab_size));
+                if (chunk == nullptr) {
+                    return nullptr;
+                }
+                state.bump = chunk;
+                state.end = chunk + kChunkSize;
+            }
+            mem = state.bump;
+            state.bump += slab_size;
+        }
+
+        if (!Map.set(mem, slab_size, static_cast<uint8_t>(size_class + 1))) {
+            releaseSlab(mem, slab_size, size_class);
+            return nullptr;
+        }
+        return mem;
+    }
+
+    static void releaseSlab(void * mem, size_t slab_size, size_t size_class) {
+        Map.set(mem, slab_size, 0);
+
+        SlabSizeState & state = states_[SlabSizeIndex(slab_size)];
+        FreeSlab * slab = reinterpret_cast<FreeSlab *>(mem);
+        slab->next = state.free_slabs;
+        state.free_slabs = slab;
+    }
+
+private:
+    struct FreeSlab {
+        FreeSlab * next;
+    };
+
+    struct SlabSizeState {
+        char * bump;
+        char * end;
+        FreeSlab * free_slabs;
+    };
+
+    static size_t SlabSizeIndex(size_t slab_size) {
+        size_t index = 0;
+        while ((kPageSize << index) < slab_size) {
+            ++index;
+        }
+        return index;
+    }
+
+    static const constexpr size_t kNumSlabSizes = 9; // kPageSize up to kChunkSize
+
+    static SlabSizeState states_[kNumSlabSizes];
+};
+
+template <PageMap & Map>
+typename SlabSource<Map>::SlabSizeState SlabSource<Map>::states_[SlabSource<Map>::kNumSlabSizes];
+
+namespace detail {
+struct LargeHeader {
+    static const constexpr size_t kMagic = 0x4c41524745484452; // "LARGEHDR"
+
+    void * mapping;
+    size_t mapping_size;
+    size_t usable_size;
+    size_t magic;
+    bool zeroed; // False once the mapping has been handed out before, see LargeSpanCache
+};
+
+static_assert(sizeof(LargeHeader) <= kLargeHeaderSize, "LargeHeader does not fit in kLargeHeaderSize");
+
+inline LargeHeader * HeaderOf(void * p) {
+    LargeHeader * header = reinterpret_cast<LargeHeader *>(reinterpret_cast<char *>(p) - kLargeHeaderSize);
+    assert(header->magic == LargeHeader::kMagic); // p did not come from AllocateLarge
+    return header;
+}
+
+inline void * PlaceLarge(char * mapping, size_t mapping_size, size_t offset, bool zeroed) {
+    char * p = mapping + offset;
+    LargeHeader * header = reinterpret_cast<LargeHeader *>(p - kLargeHeaderSize);
+    header->mapping = mapping;
+    header->mapping_size = mapping_size;
+    header->usable_size = mapping_size - offset;
+    header->magic = LargeHeader::kMagic;
+    header->zeroed = zeroed;
+    return p;
+}
+
+// Where the pointer sits in its mapping: past the header, rounded up to alignment
+inline size_t LargeOffset(size_t alignment) {
+    return RoundUp(kLargeHeaderSize, std::max(alignment, kLargeHeaderSize));
+}
+} // namespace detail
+
+// Page-granular allocation with its own mapping, aligned to at least kLargeHeaderSize. The memory is zeroed.
+inline void * AllocateLarge(size_t size, size_t alignment) {
+    size_t offset = detail::LargeOffset(alignment);
+    if (size > ~size_t(0) - offset - kPageSize) {
+        return nullptr;
+    }
+
+    size_t mapping_size = RoundUp(offset + size, kPageSize);
+    char * mapping = reinterpret_cast<char *>(MapPages(mapping_size, std::max(alignment, kLargeHeaderSize)));
+    if (mapping == nullptr) {
+        return nullptr;
+    }
+    return detail::PlaceLarge(mapping, mapping_size, offset, true);
+}
+
+inline void FreeLarge(void * p) {
+    detail::LargeHeader * header = detail::HeaderOf(p);
+    header->magic = 0;
+    UnmapPages(header->mapping, header->mapping_size);
+}
+
+inline size_t LargeUsableSize(void * p) {
+    return detail::HeaderOf(p)->usable_size;
+}
+
+// Whether p still holds nothing but zeroes, as when it was first mapped
+inline bool LargeIsZeroed(void * p) {
+    return detail::HeaderOf(p)->zeroed;
+}
+
+// AllocateLarge() and FreeLarge() with freed mappings of up to kMaxSpanSize kept for reuse, since an mmap() and a
+// munmap() per request cost far more than the memory. Spans are rounded up to one of a few sizes per doubling and kept
+// on a free list per size, so a lookup is a single pop. At most kMaxCachedBytes are kept, anything past that and
+// anything larger than kMaxSpanSize is unmapped as before. Alignments above a page are met by placing the pointer
+// inside a span that has room for it. Reused spans are not zeroed, see LargeIsZeroed().
+//
+// Constant-initialized and never calls malloc, so it can sit under malloc as a static. Thread-safe.
+class LargeSpanCache {
+public:
+    static const constexpr size_t kMaxSpanSize = 1024 * 1024;
+    static const constexpr size_t kMaxCachedBytes = 32 * 1024 * 1024;
+
+    void * allocate(size_t size, size_t alignment) {
+        // Spans are only page aligned, so past a page this is the most the pointer can end up from the span start
+        size_t max_offset = detail::LargeOffset(alignment);
+        if (max_offset > kMaxSpanSize || size > kMaxSpanSize - max_offset) {
+            return AllocateLarge(size, alignment);
+        }
+
+        size_t span_class = SpanClass(RoundUp(max_offset + size, kPageSize) / kPageSize);
+        size_t mapping_size = SpanClassPages(span_class) * kPageSize;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            FreeSpan * span = free_spans_[span_class];
+            if (span != nullptr) {
+                free_spans_[span_class] = span->next;
+                cached_bytes_ -= mapping_size;
+                char * mapping = reinterpret_cast<char *>(span);
+                return detail::PlaceLarge(mapping, mapping_size, OffsetIn(mapping, alignment), false);
+            }
+        }
+
+        char * mapping = reinterpret_cast<char *>(MapPages(mapping_size, kPageSize));
+        if (mapping == nullptr) {
+            return nullptr;
+        }
+        return detail::PlaceLarge(mapping, mapping_size, OffsetIn(mapping, alignment), true);
+    }
+
+    void deallocate(void * p) {
+        detail::LargeHeader * header = detail::HeaderOf(p);
+        char * mapping = reinterpret_cast<char *>(header->mapping);
+        size_t mapping_size = header->mapping_size;
+
+        // Oversized mappings came straight from AllocateLarge() and mostly have no span class
+        size_t span_class = SpanClass(mapping_size / kPageSize);
+        if (span_class < kNumSpanClasses && SpanClassPages(span_class) * kPageSize == mapping_size) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (cached_bytes_ + mapping_size <= kMaxCachedBytes) {
+                header->magic = 0;
+                FreeSpan * span = reinterpret_cast<FreeSpan *>(mapping);
+                span->next = free_spans_[span_class];
+                free_spans_[span_class] = span;
+                cached_bytes_ += mapping_size;
+                return;
+            }
+        }
+        FreeLarge(p);
+    }
+
+    // For pthread_atfork
+    void lock() {
+        mutex_.lock();
+    }
+
+    void unlock() {
+        mutex_.unlock();
+    }
+
+private:
+    struct FreeSpan {
+        FreeSpan * next;
+    };
+
+    static size_t OffsetIn(char * mapping, size_t alignment) {
+        uintptr_t begin = reinterpret_cast<uintptr_t>(mapping);
+        return RoundUp(begin + kLargeHeaderSize, std::max(alignment, kLargeHeaderSize)) - begin;
+    }
+
+    // 1 to 8 pages exactly, then 4 sizes per doubling
+    static size_t SpanClassPages(size_t span_class) {
+        if (span_class < 8) {
+            return span_class + 1;
+        }
+        size_t doubling = (span_class - 8) / 4;
+        size_t step = size_t(2) << doubling;
+        return (size_t(8) << doubling) + ((span_class - 8) % 4 + 1) * step;
+    }
+
+    // kNumSpanClasses if pages is above kMaxSpanSize
+    static size_t SpanClass(size_t pages) {
+        size_t span_class = 0;
+        while (span_class < kNumSpanClasses && SpanClassPages(span_class) < pages) {
+            ++span_class;
+        }
+        return span_class;
+    }
+
+    static const constexpr size_t kNumSpanClasses = 28; // 1 page up to kMaxSpanSize
+
+    std::mutex mutex_;
+    FreeSpan * free_spans_[kNumSpanClasses] = {};
+    size_t cached_bytes_ = 0;
+};
+} // namespace PageHeap
+} // namespace AllocatorBuilder
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+
+namespace AllocatorBuilder {
+namespace SharedState {
+// State shared by an allocator, all its copies and everything rebound from it. Allocators whose state depends on the
+// value type (e.g. a slab pool of T) keep one State per type here, so that rebinding to U and back to T finds the
+// original pool again and the round trip compares equal, as std::allocator_traits requires.
+// Allocators built this way are handles on shared state: two compare equal only if they share it, so they set
+// is_always_equal to false and propagate on container copy, move and swap.
+//
+// get() locks, so allocators look their state up once when constructed and keep the pointer. args only construct the
+// State on first use, later calls return the existing one.
+class StateGroup {
+public:
+    template <class State, class... Args>
+    State & get(Args&&... args) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::shared_ptr<void> & state = states_[std::type_index(typeid(State))];
+        if (state == nullptr) {
+            state = std::make_shared<State>(std::forward<Args>(args)...);
+        }
+
+        return *static_cast<State *>(state.get());
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::type_index, std::shared_ptr<void>> states_;
+};
+
+inline std::shared_ptr<StateGroup> MakeStateGroup() {
+    return std::make_shared<StateGroup>();
+}
+} // namespace SharedState
+} // namespace AllocatorBuilder
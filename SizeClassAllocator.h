@@ -0,0 +1,448 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "HeapIntrospection.h"
+#include "SizeClasses.h"
+#include "WarmStart.h"
+
+namespace AllocatorBuilder {
+namespace SizeClassAllocator {
+namespace detail {
+// Lives at the start of every slab. Slabs are aligned to their own (power of 2) size, so the header of any object
+// can be found by masking the object's address.
+struct SlabHeader {
+    SlabHeader * next = nullptr;
+    SlabHeader * prev = nullptr;
+
+    void * free_list = nullptr; // Intrusive list of objects that were handed out and returned
+    char * bump = nullptr;      // Objects from here on have never been handed out
+    char * end = nullptr;
+
+    size_t size_class = 0;
+    size_t num_allocated = 0;
+};
+
+static_assert(sizeof(SlabHeader) <= SizeClasses::kSlabHeaderSize, "SlabHeader does not fit in the space reserved by the size class table");
+
+// Intrusive doubly linked list of slabs
+class SlabList {
+public:
+    bool empty() const { return head_ == nullptr; }
+
+    SlabHeader * front() const { return head_; }
+
+    void push_front(SlabHeader * slab) {
+        slab->prev = nullptr;
+        slab->next = head_;
+        if (head_ != nullptr) {
+            head_->prev = slab;
+        }
+        head_ = slab;
+    }
+
+    void erase(SlabHeader * slab) {
+        if (slab->prev != nullptr) {
+            slab->prev->next = slab->next;
+        } else {
+            head_ = slab->next;
+        }
+
+        if (slab->next != nullptr) {
+            slab->next->prev = slab->prev;
+        }
+
+        slab->next = nullptr;
+        slab->prev = nullptr;
+    }
+
+private:
+    SlabHeader * head_ = nullptr;
+};
+
+// Default source of slab memory. A SlabSource hands out slab_size bytes aligned to slab_size, and is told the size
+// class so it can keep its own bookkeeping (see PageHeap::SlabSource).
+struct PosixMemalignSlabSource {
+    static void * allocateSlab(size_t slab_size, size_t size_class) {
+        void * mem;
+        int res = posix_memalign(&mem, slab_size, slab_size);
+        return res == 0 ? mem : nullptr;
+    }
+
+    static void releaseSlab(void * mem, size_t slab_size, size_t size_class) {
+        free(mem);
+    }
+};
+
+// Untyped slab heap serving every size class in SizeClasses. Not thread-safe.
+template <class SlabSource = PosixMemalignSlabSource>
+class SizeClassHeap {
+public:
+    constexpr SizeClassHeap() = default;
+
+    SizeClassHeap(const SizeClassHeap &) = delete;
+    SizeClassHeap & operator=(const SizeClassHeap &) = delete;
+
+    ~SizeClassHeap() {
+        for (auto & bin : bins_) {
+            releaseAll(bin.available);
+            releaseAll(bin.full);
+            if (bin.cached_empty != nullptr) {
+                releaseSlab(bin.cached_empty);
+            }
+        }
+    }
+
+    void * allocate(size_t size_class) {
+        assert(size_class < SizeClasses::kNumSizeClasses);
+        Bin & bin = bins_[size_class];
+
+        SlabHeader * slab = bin.available.front();
+        if (slab == nullptr) {
+            if (bin.cached_empty != nullptr) {
+                slab = bin.cached_empty;
+                bin.cached_empty = nullptr;
+            } else {
+                slab = createSlab(size_class);
+                if (slab == nullptr) {
+                    return nullptr;
+                }
+                ++bin.num_slabs;
+            }
+            bin.available.push_front(slab);
+        }
+
+        void * ptr;
+        if (slab->free_list != nullptr) {
+            ptr = slab->free_list;
+            slab->free_list = *reinterpret_cast<void **>(ptr);
+        } else {
+            assert(slab->bump + SizeClasses::ClassToSize(size_class) <= slab->end);
+            ptr = slab->bump;
+            slab->bump += SizeClasses::ClassToSize(size_class);
+        }
+
+        ++bin.num_allocated;
+        if (++slab->num_allocated == SizeClasses::ClassToObjectsPerSlab(size_class)) {
+            bin.available.erase(slab);
+            bin.full.push_front(slab);
+            ++bin.num_full;
+        }
+
+        return ptr;
+    }
+
+    void deallocate(void * p, size_t size_class) {
+        assert(size_class < SizeClasses::kNumSizeClasses);
+        Bin & bin = bins_[size_class];
+
+        SlabHeader * slab = SlabOf(p, size_class);
+        assert(slab->size_class == size_class); // Deallocated with a different size than it was allocated with
+        assert(slab->num_allocated > 0);
+
+        *reinterpret_cast<void **>(p) = slab->free_list;
+        slab->free_list = p;
+
+        --bin.num_allocated;
+        if (slab->num_allocated-- == SizeClasses::ClassToObjectsPerSlab(size_class)) {
+            bin.full.erase(slab);
+            bin.available.push_front(slab);
+            --bin.num_full;
+        }
+
+        if (slab->num_allocated == 0 && bin.num_slabs > bin.num_reserved) {
+            // Keep one empty slab per class around so that alloc/free ping-pong does not hit the backing memory.
+            // Reserved slabs stay where they are.
+            bin.available.erase(slab);
+            if (bin.cached_empty == nullptr) {
+                bin.cached_empty = slab;
+            } else {
+                releaseSlab(slab);
+                --bin.num_slabs;
+            }
+        }
+    }
+
+    // Creates slabs until size_class owns num_slabs of them and keeps at least that many from then on. false if the
+    // slab source ran out of memory.
+    bool reserve(size_t size_class, size_t num_slabs, const WarmStart::ReserveOptions & options, WarmStart::ReservationReport & report) {
+        assert(size_class < SizeClasses::kNumSizeClasses);
+        Bin & bin = bins_[size_class];
+        bin.num_reserved = std::max(bin.num_reserved, num_slabs);
+
+        while (bin.num_slabs < num_slabs) {
+            SlabHeader * slab = createSlab(size_class);
+            if (slab == nullptr) {
+                return false;
+            }
+            ++bin.num_slabs;
+            bin.available.push_front(slab);
+
+            size_t locked_before = report.bytes_locked;
+            WarmStart::PrepareRegion(slab, SizeClasses::ClassToSlabSize(size_class), options, report);
+            locked_ = locked_ || report.bytes_locked != locked_before;
+        }
+
+        return true;
+    }
+
+    // Counters are kept per class and only partially used slabs are walked, so this is cheap enough to sample
+    // periodically. The heap only sees size classes, so requested_bytes is reported as live_bytes.
+    HeapIntrospection::SlabHeapStats stats() const {
+        HeapIntrospection::SlabHeapStats stats;
+
+        for (size_t size_class = 0; size_class < SizeClasses::kNumSizeClasses; ++size_class) {
+            const Bin & bin = bins_[size_class];
+            size_t objects_per_slab = SizeClasses::ClassToObjectsPerSlab(size_class);
+
+            stats.num_slabs += bin.num_slabs;
+            stats.slab_bytes += bin.num_slabs * SizeClasses::ClassToSlabSize(size_class);
+            stats.slot_bytes += bin.num_slabs * objects_per_slab * SizeClasses::ClassToSize(size_class);
+            stats.live_bytes += bin.num_allocated * SizeClasses::ClassToSize(size_class);
+
+            stats.occupancy.add(objects_per_slab, objects_per_slab, bin.num_full);
+            stats.occupancy.add(0, objects_per_slab, bin.cached_empty != nullptr ? 1 : 0);
+            for (SlabHeader * slab = bin.available.front(); slab != nullptr; slab = slab->next) {
+                stats.occupancy.add(slab->num_allocated, objects_per_slab);
+            }
+        }
+
+        stats.requested_bytes = stats.live_bytes;
+        return stats;
+    }
+
+    // One line per size class that owns slabs, one glyph per slab
+    void dumpHeapMap(std::ostream & os) const {
+        for (size_t size_class = 0; size_class < SizeClasses::kNumSizeClasses; ++size_class) {
+            const Bin & bin = bins_[size_class];
+            if (bin.num_slabs == 0) {
+                continue;
+            }
+
+            size_t objects_per_slab = SizeClasses::ClassToObjectsPerSlab(size_class);
+            os << SizeClasses::ClassToSize(size_class) << "\t";
+            for (SlabHeader * slab = bin.available.front(); slab != nullptr; slab = slab->next) {
+                os << HeapIntrospection::OccupancyGlyph(slab->num_allocated, objects_per_slab);
+            }
+            os << std::string(bin.num_full, '#');
+            if (bin.cached_empty != nullptr) {
+                os << '.';
+            }
+            os << '\n';
+        }
+    }
+
+    static SlabHeader * SlabOf(void * p, size_t size_class) {
+        uintptr_t mask = ~(uintptr_t(SizeClasses::ClassToSlabSize(size_class)) - 1);
+        return reinterpret_cast<SlabHeader *>(reinterpret_cast<uintptr_t>(p) & mask);
+    }
+
+private:
+    struct Bin {
+        SlabList available; // Slabs with at least one free object
+        SlabList full;
+        SlabHeader * cached_empty = nullptr;
+
+        size_t num_slabs = 0;     // Including cached_empty
+        size_t num_full = 0;
+        size_t num_allocated = 0; // Objects handed out across all slabs
+        size_t num_reserved = 0;  // Empty slabs are not released while num_slabs is at most this
+    };
+
+    static SlabHeader * createSlab(size_t size_class) {
+        void * mem = SlabSource::allocateSlab(SizeClasses::ClassToSlabSize(size_class), size_class);
+        if (mem == nullptr) {
+            return nullptr;
+        }
+
+        char * base = reinterpret_cast<char *>(mem);
+        SlabHeader * slab = ::new(mem) SlabHeader();
+        slab->size_class = size_class;
+        slab->bump = base + SizeClasses::kSlabHeaderSize;
+        slab->end = slab->bump + SizeClasses::ClassToObjectsPerSlab(size_class) * SizeClasses::ClassToSize(size_class);
+        return slab;
+    }
+
+    void releaseSlab(SlabHeader * slab) {
+        size_t size_class = slab->size_class;
+        if (locked_) {
+            munlock(slab, SizeClasses::ClassToSlabSize(size_class));
+        }
+        slab->~SlabHeader();
+        SlabSource::releaseSlab(slab, SizeClasses::ClassToSlabSize(size_class), size_class);
+    }
+
+    void releaseAll(SlabList & list) {
+        while (!list.empty()) {
+            SlabHeader * slab = list.front();
+            list.erase(slab);
+            releaseSlab(slab);
+        }
+    }
+
+    Bin bins_[SizeClasses::kNumSizeClasses];
+    bool locked_ = false; // Some slab was mlock()ed by reserve()
+};
+
+// What SizeClassAllocator handles share, whatever their value type
+struct SizeClassAllocatorState {
+    SizeClassHeap<> heap;
+    size_t requested_bytes = 0;
+};
+} // namespace detail
+
+// One allocator for every size up to SizeClasses::kMaxSmallSize. Requests are rounded up to their size class and served
+// from per-class slabs, larger requests go to BackingAllocator.
+template <class T, template<class> class BackingAllocator>
+class SizeClassAllocator {
+public:
+    static_assert(alignof(T) <= alignof(std::max_align_t), "Over-aligned types are not supported, use AlignedAllocator");
+
+    // std::allocator_traits
+    using value_type = T;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using reference = T&;
+    using const_reference = const T&;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <class U>
+    struct rebind {
+        typedef SizeClassAllocator<U, BackingAllocator> other;
+    };
+
+    using is_always_equal = std::false_type;
+
+    // custom allocator traits
+    using thread_safe = std::false_type;
+
+    SizeClassAllocator() : state_(std::make_shared<detail::SizeClassAllocatorState>()) {}
+
+    template <class U>
+    SizeClassAllocator(const SizeClassAllocator<U, BackingAllocator> & other)
+        : state_(other.state_), large_allocator_(other.large_allocator_) {}
+
+    pointer address(reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    const_pointer address(const_reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    T* allocate(std::size_t n, const void * hint) {
+        // purposefully ignore hint
+        return allocate(n);
+    }
+
+    T* allocate(std::size_t n) {
+        if (n > max_size()) {
+            throw std::length_error("Tried to allocate more than the allocator will support");
+        }
+
+        std::size_t bytes = n * sizeof(T);
+        if (bytes > SizeClasses::kMaxSmallSize) {
+            return large_allocator_.allocate(n);
+        }
+
+        void * mem = state_->heap.allocate(SizeClasses::SizeToClass(bytes));
+        if (mem == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        state_->requested_bytes += bytes;
+        return reinterpret_cast<T*>(mem);
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        std::size_t bytes = n * sizeof(T);
+        if (bytes > SizeClasses::kMaxSmallSize) {
+            large_allocator_.deallocate(p, n);
+            return;
+        }
+
+        state_->heap.deallocate(p, SizeClasses::SizeToClass(bytes));
+        state_->requested_bytes -= bytes;
+    }
+
+    size_type max_size() const noexcept {
+        return std::numeric_limits<size_type>::max() / sizeof(value_type);
+    }
+
+    template <class U, class... Args>
+    void construct(U * p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U>
+    void destroy(U * p) {
+        p->~U();
+    }
+
+    // Pre-creates num_slabs slabs for the size class serving requests of bytes, and keeps that many around from then on.
+    // Call it once per size the program is known to use, before the first request.
+    WarmStart::ReservationReport reserve(std::size_t bytes, std::size_t num_slabs, const WarmStart::ReserveOptions & options = WarmStart::ReserveOptions()) {
+        if (bytes > SizeClasses::kMaxSmallSize) {
+            throw std::invalid_argument("Only sizes up to SizeClasses::kMaxSmallSize are served from slabs");
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        WarmStart::ReservationReport report;
+        if (!state_->heap.reserve(SizeClasses::SizeToClass(bytes), num_slabs, options, report)) {
+            throw std::bad_alloc();
+        }
+
+        report.milliseconds = WarmStart::MillisecondsSince(start);
+        return report;
+    }
+
+    // Covers the slabs only, allocations larger than SizeClasses::kMaxSmallSize are not counted
+    HeapIntrospection::SlabHeapStats stats() const {
+        HeapIntrospection::SlabHeapStats stats = state_->heap.stats();
+        stats.requested_bytes = state_->requested_bytes;
+        return stats;
+    }
+
+    void dumpHeapMap(std::ostream & os) const {
+        state_->heap.dumpHeapMap(os);
+    }
+
+    template <class U>
+    bool operator==(const SizeClassAllocator<U, BackingAllocator> & other) const noexcept {
+        return state_ == other.state_;
+    }
+
+    template <class U>
+    bool operator!=(const SizeClassAllocator<U, BackingAllocator> & other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    template <class U, template<class> class OtherBackingAllocator>
+    friend class SizeClassAllocator;
+
+    std::shared_ptr<detail::SizeClassAllocatorState> state_;
+    BackingAllocator<T> large_allocator_;
+};
+} // namespace SizeClassAllocator
+} // namespace AllocatorBuilder
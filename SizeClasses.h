@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace AllocatorBuilder {
+namespace SizeClasses {
+// jemalloc-like size classes: 8, then 16..128 in steps of 16, then 4 classes per doubling up to kMaxSmallSize.
+// Everything here is computed at compile time, so mapping a size to its class is a single table load.
+constexpr size_t kPageSize = 4096;
+constexpr size_t kMaxSmallSize = 8192;
+constexpr size_t kMaxSlabSize = 64 * 1024;
+
+// Every slab starts with a header of (at most) this many bytes, see SizeClassAllocator::detail::SlabHeader
+constexpr size_t kSlabHeaderSize = 64;
+
+// A slab size is picked per class so that at most 1/kMaxWasteDivisor of the slab is lost to the header and the tail
+constexpr size_t kMaxWasteDivisor = 8;
+
+constexpr size_t kLookupGranularity = 8;
+constexpr size_t kLookupTableSize = kMaxSmallSize / kLookupGranularity + 1;
+
+namespace detail {
+constexpr size_t Log2(size_t n) {
+    size_t log = 0;
+    while (n > 1) {
+        n >>= 1;
+        ++log;
+    }
+    return log;
+}
+
+constexpr size_t kNumTinyClasses = 9; // 8, 16, 32, ..., 128
+constexpr size_t kClassesPerDoubling = 4;
+
+constexpr size_t ComputeClassSize(size_t size_class) {
+    if (size_class == 0) {
+        return 8;
+    } else if (size_class < kNumTinyClasses) {
+        return 16 * size_class;
+    }
+
+    size_t group = (size_class - kNumTinyClasses) / kClassesPerDoubling;
+    size_t step = (size_class - kNumTinyClasses) % kClassesPerDoubling + 1;
+    size_t base = size_t(128) << group;
+    return base + step * (base / kClassesPerDoubling);
+}
+
+constexpr size_t ComputeObjectsPerSlab(size_t slab_size, size_t class_size) {
+    return (slab_size - kSlabHeaderSize) / class_size;
+}
+
+constexpr size_t ComputeSlabWaste(size_t slab_size, size_t class_size) {
+    return slab_size - ComputeObjectsPerSlab(slab_size, class_size) * class_size;
+}
+
+constexpr size_t ComputeSlabSize(size_t class_size) {
+    // Slabs are powers of 2 so they can be aligned to their own size
+    size_t slab_size = kPageSize;
+    while (slab_size < kMaxSlabSize && ComputeSlabWaste(slab_size, class_size) * kMaxWasteDivisor > slab_size) {
+        slab_size *= 2;
+    }
+    return slab_size;
+}
+} // namespace detail
+
+constexpr size_t kNumSizeClasses = detail::kNumTinyClasses + detail::kClassesPerDoubling * (detail::Log2(kMaxSmallSize) - detail::Log2(128));
+
+static_assert(detail::ComputeClassSize(kNumSizeClasses - 1) == kMaxSmallSize, "The largest size class must be kMaxSmallSize");
+static_assert(kNumSizeClasses <= 256, "Size class indices must fit in the uint8_t lookup table");
+
+struct SizeClassTable {
+    size_t class_size[kNumSizeClasses];
+    size_t slab_size[kNumSizeClasses];
+    size_t objects_per_slab[kNumSizeClasses];
+
+    // Indexed by ceil(size / kLookupGranularity)
+    uint8_t class_for_size[kLookupTableSize];
+};
+
+namespace detail {
+constexpr SizeClassTable MakeSizeClassTable() {
+    SizeClassTable table{};
+
+    for (size_t size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+        size_t class_size = ComputeClassSize(size_class);
+        table.class_size[size_class] = class_size;
+        table.slab_size[size_class] = ComputeSlabSize(class_size);
+        table.objects_per_slab[size_class] = ComputeObjectsPerSlab(table.slab_size[size_class], class_size);
+    }
+
+    size_t size_class = 0;
+    for (size_t index = 0; index < kLookupTableSize; ++index) {
+        while (table.class_size[size_class] < index * kLookupGranularity) {
+            ++size_class;
+        }
+        table.class_for_size[index] = static_cast<uint8_t>(size_class);
+    }
+
+    return table;
+}
+
+constexpr bool AllClassesWithinWasteBound(const SizeClassTable & table) {
+    for (size_t size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+        if (table.objects_per_slab[size_class] == 0 ||
+            ComputeSlabWaste(table.slab_size[size_class], table.class_size[size_class]) * kMaxWasteDivisor > table.slab_size[size_class]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Template so the table can live in a header without violating the ODR
+template <class Dummy = void>
+struct SizeClassTableStorage {
+    static constexpr SizeClassTable value = MakeSizeClassTable();
+};
+
+template <class Dummy>
+constexpr SizeClassTable SizeClassTableStorage<Dummy>::value;
+} // namespace detail
+
+static_assert(detail::AllClassesWithinWasteBound(detail::SizeClassTableStorage<>::value), "Some size class exceeds the slab waste bound, raise kMaxSlabSize");
+
+constexpr const SizeClassTable & Table() {
+    return detail::SizeClassTableStorage<>::value;
+}
+
+// Only valid for size <= kMaxSmallSize
+constexpr size_t SizeToClass(size_t size) {
+    return Table().class_for_size[(size + kLookupGranularity - 1) / kLookupGranularity];
+}
+
+constexpr size_t ClassToSize(size_t size_class) {
+    return Table().class_size[size_class];
+}
+
+constexpr size_t ClassToSlabSize(size_t size_class) {
+    return Table().slab_size[size_class];
+}
+
+constexpr size_t ClassToObjectsPerSlab(size_t size_class) {
+    return Table().objects_per_slab[size_class];
+}
+
+static_assert(SizeToClass(0) == 0 && SizeToClass(8) == 0 && SizeToClass(9) == 1, "Size class lookup is broken");
+static_assert(ClassToSize(SizeToClass(129)) == 160, "Size class lookup is broken");
+static_assert(SizeToClass(kMaxSmallSize) == kNumSizeClasses - 1, "Size class lookup is broken");
+} // namespace SizeClasses
+} // namespace AllocatorBuilder
@@ -1,55 +1,51 @@
 #pragma once
 
 #include <stdlib.h>
+#include <sys/mman.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <deque>
 #include <limits>
 #include <list>
+#include <memory>
 #include <new>
+#include <ostream>
 #include <type_traits>
+#include <utility>
+
+#include "HeapIntrospection.h"
+#include "SharedState.h"
+#include "WarmStart.h"
 
 namespace AllocatorBuilder {
 namespace SlabAllocator {
+namespace detail {
+// The slabs of one value type. Every SlabAllocator rebound to T from the same original allocator shares one pool.
 template <class T, template<class> class BackingAllocator>
-class SlabAllocator {
+class SlabPool {
 public:
-    // std::allocator_traits
-    using value_type = T;
-    using pointer = T*;                     
-    using const_pointer = const T*;         
-    using reference = T&;                   
-    using const_reference = const T&;       
-    using size_type = std::size_t;          
-    using difference_type = std::ptrdiff_t; 
-    using propagate_on_container_move_assignment = std::true_type;
+    using pointer = T*;
+    using const_pointer = const T*;
 
-//    template<class U, template<class> class OtherBackingAllocator>
-//    struct rebind {
-//        typedef SlabAllocator<U, OtherBackingAllocator> other;
-//    };
+    SlabPool() = default;
 
-    using is_always_equal = std::true_type;
-
-    // custom allocator traits
-    using thread_safe = std::false_type;
+    SlabPool(const SlabPool &) = delete;
+    SlabPool & operator=(const SlabPool &) = delete;
 
-    pointer address(reference x) const noexcept { 
-        return std::addressof(x);
-    }
-
-    const_pointer address(const_reference x) const noexcept {
-        return std::addressof(x);
-    }
-
-    T* allocate(std::size_t n, const void * hint) {
-        // purposefully ignore hint
-        return allocate(n);
+    ~SlabPool() {
+        if (locked_) {
+            for (Slab & slab : allocated_slabs_) {
+                WarmStart::UnlockInteriorPages(&slab, sizeof(Slab));
+            }
+        }
     }
 
     T * allocate(std::size_t n) {
         if (n > Slab::NUM_SLAB_ELEMENTS) {
-            return nullptr;
+            // Does not fit in a slab at all
+            return large_allocator_.allocate(n);
         }
 
         if (!empty_slabs_.empty()) {
@@ -63,8 +59,10 @@ public:
                     assert(0); // We just allocated to slab, it can never be empty!
                 case Slab::SlabMetadata::SlabStatus::PARTIAL:
                     partial_slabs_.push_back(slab);
+                    break;
                 case Slab::SlabMetadata::SlabStatus::FULL:
                     full_slabs_.push_back(slab);
+                    break;
             }
 
             return ptr;
@@ -106,7 +104,12 @@ public:
     }
 
     void deallocate(T * p, std::size_t n) {
-        auto partial_it = std::find_if(partial_slabs_.begin(), partial_slabs_.end(), [p, n](const_pointer slab) { return slab->wasAllocatedHere(p, n); });
+        if (n > Slab::NUM_SLAB_ELEMENTS) {
+            large_allocator_.deallocate(p, n);
+            return;
+        }
+
+        auto partial_it = std::find_if(partial_slabs_.begin(), partial_slabs_.end(), [p, n](Slab * slab) { return slab->wasAllocatedHere(p, n); });
         if (partial_it != partial_slabs_.end()) {
             Slab * slab = *partial_it;
             slab->deallocate(p, n);
@@ -118,15 +121,14 @@ public:
             return;
         }
 
-        auto full_it = std::find_if(full_slabs_.begin(), full_slabs_.end(), [p, n](const_pointer slab) { return slab->wasAllocatedHere(p, n); });
+        auto full_it = std::find_if(full_slabs_.begin(), full_slabs_.end(), [p, n](Slab * slab) { return slab->wasAllocatedHere(p, n); });
         if (full_it != full_slabs_.end()) {
             Slab * slab = *full_it;
-            full_slabs_.erase(full_it);
             slab->deallocate(p, n);
+            // Freed slots are only reused once the whole slab is empty, until then a full slab stays full
             if (slab->getSlabStatus() == Slab::SlabMetadata::SlabStatus::EMPTY) {
+                full_slabs_.erase(full_it);
                 empty_slabs_.push_back(slab);
-            } else {
-                partial_slabs_.push_back(slab);
             }
             return;
         }
@@ -134,22 +136,68 @@ public:
         assert(0); // p was not found in partial_slabs_ or full_slabs_, something is wrong...
     }
 
-    size_type max_size() const noexcept { 
-        return std::numeric_limits<size_type>::max() / sizeof(value_type);
+    static constexpr std::size_t ObjectsPerSlab() {
+        return Slab::NUM_SLAB_ELEMENTS;
     }
 
-    template <class U, class... Args> 
-    void construct(U * p, Args&&... args) {
-        ::new((void *)p) U(std::forward<Args>(args)...);
+    // Creates empty slabs until the pool owns num_slabs of them, so the first num_slabs slabs' worth of allocations
+    // neither grow the deque nor fault. Slabs come from BackingAllocator and may share pages with other data, so only
+    // the pages wholly inside a slab are locked.
+    WarmStart::ReservationReport reserve(std::size_t num_slabs, const WarmStart::ReserveOptions & options) {
+        auto start = std::chrono::steady_clock::now();
+
+        WarmStart::ReserveOptions prefault_only = options;
+        prefault_only.lock = false;
+
+        WarmStart::ReservationReport report;
+        while (allocated_slabs_.size() < num_slabs) {
+            allocated_slabs_.emplace_back();
+            Slab * slab = &allocated_slabs_.back();
+            empty_slabs_.push_back(slab);
+            WarmStart::PrepareRegion(slab, sizeof(Slab), prefault_only, report);
+            if (options.lock && WarmStart::LockInteriorPages(slab, sizeof(Slab), report)) {
+                locked_ = true;
+            }
+        }
+
+        report.milliseconds = WarmStart::MillisecondsSince(start);
+        return report;
     }
 
-    template <class U> 
-    void destroy(U * p) {
-        p->~U();
+    // Walks every slab, O(number of slabs)
+    HeapIntrospection::SlabHeapStats stats() const {
+        HeapIntrospection::SlabHeapStats stats;
+
+        for (const Slab & slab : allocated_slabs_) {
+            ++stats.num_slabs;
+            stats.slab_bytes += sizeof(Slab);
+            stats.slot_bytes += Slab::NUM_SLAB_ELEMENTS * sizeof(T);
+            stats.live_bytes += slab.getNumLive() * sizeof(T);
+            stats.occupancy.add(slab.getNumLive(), Slab::NUM_SLAB_ELEMENTS);
+        }
+
+        stats.requested_bytes = stats.live_bytes;
+        return stats;
+    }
+
+    // One glyph per slab, in the order the slabs were created
+    void dumpHeapMap(std::ostream & os) const {
+        size_t num_glyphs = 0;
+        for (const Slab & slab : allocated_slabs_) {
+            os << HeapIntrospection::OccupancyGlyph(slab.getNumLive(), Slab::NUM_SLAB_ELEMENTS);
+            if (++num_glyphs % 64 == 0) {
+                os << '\n';
+            }
+        }
+
+        if (num_glyphs % 64 != 0) {
+            os << '\n';
+        }
     }
 
 private:
-    class Slab {
+    // One page, page aligned if BackingAllocator honours alignof (Mallocator does) so reserve() can lock all of it
+    class alignas(4096) Slab {
     public:
         class SlabMetadata{
         public:
@@ -173,20 +221,25 @@ private:
                 return NUM_SLAB_ELEMENTS - next_free_index_;
             }
 
+            // Deallocated slots are not reused until the whole slab is empty, so they count as neither live nor free
+            size_t getNumLive() const {
+                return next_free_index_ - num_deallocated_;
+            }
+
             off_t getNextFreeIndex() const {
                 return next_free_index_;
             }
 
             void incrementNextFreeIndex(std::size_t n) {
-                assert(n >= getNumFree());
+                assert(n <= getNumFree());
                 next_free_index_ += n;
             }
 
             void deallocate(std::size_t n) {
                 num_deallocated_ += n;
-                assert(num_deallocated_ <= NUM_SLAB_ELEMENTS);
+                assert(num_deallocated_ <= static_cast<size_t>(next_free_index_));
 
-                if (num_deallocated_ == NUM_SLAB_ELEMENTS) {
+                if (num_deallocated_ == static_cast<size_t>(next_free_index_)) {
                     clear(); // Reset the slab to empty!
                 }
             }
@@ -196,7 +249,7 @@ private:
                 num_deallocated_ = 0;
             }
 
-            SlabMetadata() : next_free_index_(0) {
+            SlabMetadata() : next_free_index_(0), num_deallocated_(0) {
             }
 
         private:
@@ -205,8 +258,8 @@ private:
         };
 
         T* allocate(std::size_t n) {
-            assert(n >= metadata_.getNumFree()); // We should be looking at other slab if we cant find enough space
-            T* ptr = &slab_space[metadata_.getNextFreeIndex()];
+            assert(n <= metadata_.getNumFree()); // We should be looking at other slab if we cant find enough space
+            T* ptr = reinterpret_cast<T*>(&slab_space[metadata_.getNextFreeIndex()]);
             metadata_.incrementNextFreeIndex(n);
             return ptr;
         }
@@ -224,8 +277,12 @@ private:
             return metadata_.getNumFree();
         }
 
+        size_t getNumLive() const {
+            return metadata_.getNumLive();
+        }
+
         bool wasAllocatedHere(pointer p, std::size_t n) {
-            return p >= &slab_space[0] && p <= &slab_space[NUM_SLAB_ELEMENTS - 1];
+            return p >= reinterpret_cast<T*>(&slab_space[0]) && p <= reinterpret_cast<T*>(&slab_space[NUM_SLAB_ELEMENTS - 1]);
             // TODO: For now ignore n, but we can write code in the future to assert for the cases for n > 1.
         }
 
@@ -235,7 +292,8 @@ private:
         static const constexpr size_t NUM_SLAB_ELEMENTS = (SLAB_SIZE - sizeof(SlabMetadata)) / sizeof(T);
 
     private:
-        T slab_space[NUM_SLAB_ELEMENTS];
+        // Raw storage, objects are only constructed by the container
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type slab_space[NUM_SLAB_ELEMENTS];
 
         SlabMetadata metadata_;
     };
@@ -245,6 +303,116 @@ private:
     std::list<Slab *> empty_slabs_;
     std::list<Slab *> partial_slabs_;
     std::list<Slab *> full_slabs_;
+
+    BackingAllocator<T> large_allocator_;
+
+    bool locked_ = false;
+};
+} // namespace detail
+
+template <class T, template<class> class BackingAllocator>
+class SlabAllocator {
+public:
+    // std::allocator_traits
+    using value_type = T;
+    using pointer = T*;                     
+    using const_pointer = const T*;         
+    using reference = T&;                   
+    using const_reference = const T&;       
+    using size_type = std::size_t;          
+    using difference_type = std::ptrdiff_t; 
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <class U>
+    struct rebind {
+        typedef SlabAllocator<U, BackingAllocator> other;
+    };
+
+    using is_always_equal = std::false_type;
+
+    // custom allocator traits
+    using thread_safe = std::false_type;
+
+    SlabAllocator() : SlabAllocator(SharedState::MakeStateGroup()) {}
+
+    template <class U>
+    SlabAllocator(const SlabAllocator<U, BackingAllocator> & other) : SlabAllocator(other.state_group_) {}
+
+    pointer address(reference x) const noexcept { 
+        return std::addressof(x);
+    }
+
+    const_pointer address(const_reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    T* allocate(std::size_t n, const void * hint) {
+        // purposefully ignore hint
+        return allocate(n);
+    }
+
+    T * allocate(std::size_t n) {
+        return pool_->allocate(n);
+    }
+
+    void deallocate(T * p, std::size_t n) {
+        pool_->deallocate(p, n);
+    }
+
+    size_type max_size() const noexcept { 
+        return std::numeric_limits<size_type>::max() / sizeof(value_type);
+    }
+
+    template <class U, class... Args> 
+    void construct(U * p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U> 
+    void destroy(U * p) {
+        p->~U();
+    }
+
+    static constexpr std::size_t ObjectsPerSlab() {
+        return Pool::ObjectsPerSlab();
+    }
+
+    // Reserves slabs for this value type only, rebound allocators have their own
+    WarmStart::ReservationReport reserve(std::size_t num_slabs, const WarmStart::ReserveOptions & options = WarmStart::ReserveOptions()) {
+        return pool_->reserve(num_slabs, options);
+    }
+
+    HeapIntrospection::SlabHeapStats stats() const {
+        return pool_->stats();
+    }
+
+    void dumpHeapMap(std::ostream & os) const {
+        pool_->dumpHeapMap(os);
+    }
+
+    template <class U>
+    bool operator==(const SlabAllocator<U, BackingAllocator> & other) const noexcept {
+        return state_group_ == other.state_group_;
+    }
+
+    template <class U>
+    bool operator!=(const SlabAllocator<U, BackingAllocator> & other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    template <class U, template<class> class OtherBackingAllocator>
+    friend class SlabAllocator;
+
+    using Pool = detail::SlabPool<T, BackingAllocator>;
+
+    explicit SlabAllocator(std::shared_ptr<SharedState::StateGroup> state_group)
+        : state_group_(std::move(state_group)), pool_(&state_group_->template get<Pool>()) {}
+
+    std::shared_ptr<SharedState::StateGroup> state_group_;
+    Pool * pool_;
 };
 } // namespace SlabAllocator
 } // namespace AllocatorBuilder
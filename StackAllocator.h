@@ -0,0 +1,322 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace AllocatorBuilder {
+namespace StackAllocator {
+// Every allocation is rounded up to this, so the top of the stack is always suitably aligned and freeing the top
+// allocation is a single compare
+constexpr size_t kAlignment = alignof(std::max_align_t);
+
+constexpr size_t RoundUp(size_t n) {
+    return (n + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+namespace detail {
+struct alignas(kAlignment) Chunk {
+    char bytes[kAlignment];
+};
+
+// Lives at the start of every segment
+struct SegmentHeader {
+    SegmentHeader * prev;
+    char * prev_top; // Top of prev when this segment was pushed, restored when it is popped
+    size_t num_chunks;
+};
+
+static const constexpr size_t kSegmentHeaderSize = RoundUp(sizeof(SegmentHeader));
+
+// A chain of segments from BackingAllocator, used as one stack. A request that does not fit in the current segment
+// starts a new one, and once the top falls back to the start of a segment that segment is popped, so allocations in
+// older segments can be freed in order again. One popped segment is kept as a spare so a loop allocating and freeing
+// across a segment boundary does not go to BackingAllocator every time.
+template <template<class> class BackingAllocator, size_t SegmentSize>
+class StackArena {
+public:
+    // Where the stack was, for popFrame(), and the frame that was innermost before this one
+    struct Marker {
+        SegmentHeader * segment;
+        char * top;
+        SegmentHeader * outer_segment;
+        char * outer_top;
+        bool outer_open;
+    };
+
+    StackArena() = default;
+
+    StackArena(const StackArena &) = delete;
+    StackArena & operator=(const StackArena &) = delete;
+
+    ~StackArena() {
+        while (segment_ != nullptr) {
+            SegmentHeader * prev = segment_->prev;
+            releaseSegment(segment_);
+            segment_ = prev;
+        }
+        if (spare_ != nullptr) {
+            releaseSegment(spare_);
+        }
+    }
+
+    // bytes must be a multiple of kAlignment
+    void * allocate(size_t bytes) {
+        if (bytes <= static_cast<size_t>(end_ - top_)) {
+            void * p = top_;
+            top_ += bytes;
+            return p;
+        }
+        return allocateSlow(bytes);
+    }
+
+    void deallocate(void * p, size_t bytes) {
+        char * mem = reinterpret_cast<char *>(p);
+        if (mem + bytes == top_) {
+            top_ = mem;
+            if (top_ == SegmentBegin(segment_) && segment_->prev != nullptr) {
+                popSegment();
+            }
+            return;
+        }
+
+        // Only the most recent allocation can be freed, anything else is left for the innermost frame to reclaim. That
+        // only works for memory allocated since the frame was pushed, anything older would leak.
+        assert(reclaimedByFrame(mem)); // Non-LIFO deallocation the innermost frame does not cover
+    }
+
+    Marker pushFrame() {
+        Marker marker{segment_, top_, frame_segment_, frame_top_, frame_open_};
+        frame_segment_ = segment_;
+        frame_top_ = top_;
+        frame_open_ = true;
+        return marker;
+    }
+
+    // Frees everything allocated since marker was taken
+    void popFrame(const Marker & marker) {
+        assert(frame_open_ && frame_segment_ == marker.segment && frame_top_ == marker.top); // Frames popped out of order
+        frame_segment_ = marker.outer_segment;
+        frame_top_ = marker.outer_top;
+        frame_open_ = marker.outer_open;
+
+        while (segment_ != marker.segment) {
+            assert(segment_ != nullptr); // marker is not below the top of this stack
+            popSegment();
+        }
+        assert(marker.top <= top_); // marker was already popped
+        top_ = marker.top;
+    }
+
+private:
+    static char * SegmentBegin(SegmentHeader * segment) {
+        return reinterpret_cast<char *>(segment) + kSegmentHeaderSize;
+    }
+
+    static char * SegmentEnd(SegmentHeader * segment) {
+        return reinterpret_cast<char *>(segment) + segment->num_chunks * sizeof(Chunk);
+    }
+
+    // Whether mem was allocated after the innermost frame was pushed. Walks the segments above the frame, debug only.
+    bool reclaimedByFrame(const char * mem) const {
+        if (!frame_open_) {
+            return false;
+        }
+        for (SegmentHeader * segment = segment_; segment != frame_segment_; segment = segment->prev) {
+            if (mem >= SegmentBegin(segment) && mem < SegmentEnd(segment)) {
+                return true;
+            }
+        }
+        return frame_segment_ != nullptr && mem >= frame_top_ && mem < SegmentEnd(frame_segment_);
+    }
+
+    void * allocateSlow(size_t bytes) {
+        if (bytes > std::numeric_limits<size_t>::max() - kSegmentHeaderSize - SegmentSize) {
+            throw std::bad_alloc();
+        }
+
+        size_t num_chunks = std::max(SegmentSize, kSegmentHeaderSize + bytes) / sizeof(Chunk);
+        SegmentHeader * segment;
+        if (spare_ != nullptr && spare_->num_chunks >= num_chunks) {
+            segment = spare_;
+            spare_ = nullptr;
+        } else {
+            segment = reinterpret_cast<SegmentHeader *>(backing_allocator_.allocate(num_chunks));
+            segment->num_chunks = num_chunks;
+        }
+
+        segment->prev = segment_;
+        segment->prev_top = top_;
+        segment_ = segment;
+        top_ = SegmentBegin(segment);
+        end_ = SegmentEnd(segment);
+
+        void * p = top_;
+        top_ += bytes;
+        return p;
+    }
+
+    void popSegment() {
+        SegmentHeader * segment = segment_;
+        segment_ = segment->prev;
+        top_ = segment->prev_top;
+        end_ = segment_ != nullptr ? SegmentEnd(segment_) : nullptr;
+
+        if (spare_ != nullptr) {
+            releaseSegment(spare_);
+        }
+        spare_ = segment;
+    }
+
+    void releaseSegment(SegmentHeader * segment) {
+        backing_allocator_.deallocate(reinterpret_cast<Chunk *>(segment), segment->num_chunks);
+    }
+
+    char * top_ = nullptr;
+    char * end_ = nullptr;
+    SegmentHeader * segment_ = nullptr;
+    SegmentHeader * spare_ = nullptr;
+
+    // Innermost open frame, see reclaimedByFrame()
+    SegmentHeader * frame_segment_ = nullptr;
+    char * frame_top_ = nullptr;
+    bool frame_open_ = false;
+
+    BackingAllocator<Chunk> backing_allocator_;
+};
+} // namespace detail
+
+// LIFO scratch allocator: allocation bumps a pointer and deallocating the most recent allocation moves it back, both
+// without touching BackingAllocator unless a segment boundary is crossed. pushFrame() and popFrame() free a whole
+// nested scope at once. Deallocating memory out of LIFO order does nothing, and it comes back when the innermost frame
+// is popped, so containers that reallocate (std::vector growing) work as long as they are created inside that frame.
+// Freeing memory out of order that the innermost frame does not cover (allocated before it, or with no frame open)
+// would leak and trips an assert in debug builds.
+//
+// Copies and rebinds share one stack.
+template <class T, template<class> class BackingAllocator, size_t SegmentSize = 64 * 1024>
+class StackAllocator {
+public:
+    static_assert(alignof(T) <= kAlignment, "Over-aligned types are not supported, use AlignedAllocator");
+    static_assert(SegmentSize % sizeof(detail::Chunk) == 0 && SegmentSize > detail::kSegmentHeaderSize, "SegmentSize must be a multiple of kAlignment");
+
+    using Arena = detail::StackArena<BackingAllocator, SegmentSize>;
+    using Marker = typename Arena::Marker;
+
+    // std::allocator_traits
+    using value_type = T;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using reference = T&;
+    using const_reference = const T&;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <class U>
+    struct rebind {
+        typedef StackAllocator<U, BackingAllocator, SegmentSize> other;
+    };
+
+    using is_always_equal = std::false_type;
+
+    // custom allocator traits
+    using thread_safe = std::false_type;
+
+    StackAllocator() : arena_(std::make_shared<Arena>()) {}
+
+    template <class U>
+    StackAllocator(const StackAllocator<U, BackingAllocator, SegmentSize> & other) : arena_(other.arena_) {}
+
+    pointer address(reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    const_pointer address(const_reference x) const noexcept {
+        return std::addressof(x);
+    }
+
+    T* allocate(std::size_t n, const void * hint) {
+        // purposefully ignore hint
+        return allocate(n);
+    }
+
+    T* allocate(std::size_t n) {
+        if (n > max_size()) {
+            throw std::length_error("Tried to allocate more than the allocator will support");
+        }
+        return reinterpret_cast<T*>(arena_->allocate(RoundUp(n * sizeof(T))));
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        arena_->deallocate(p, RoundUp(n * sizeof(T)));
+    }
+
+    Marker pushFrame() {
+        return arena_->pushFrame();
+    }
+
+    void popFrame(const Marker & marker) {
+        arena_->popFrame(marker);
+    }
+
+    size_type max_size() const noexcept {
+        return (std::numeric_limits<size_type>::max() - kAlignment) / sizeof(value_type);
+    }
+
+    template <class U, class... Args>
+    void construct(U * p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U>
+    void destroy(U * p) {
+        p->~U();
+    }
+
+    template <class U>
+    bool operator==(const StackAllocator<U, BackingAllocator, SegmentSize> & other) const noexcept {
+        return arena_ == other.arena_;
+    }
+
+    template <class U>
+    bool operator!=(const StackAllocator<U, BackingAllocator, SegmentSize> & other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    template <class U, template<class> class OtherBackingAllocator, size_t OtherSegmentSize>
+    friend class StackAllocator;
+
+    std::shared_ptr<Arena> arena_;
+};
+
+// Pops everything allocated from allocator during its lifetime. Objects are not destroyed.
+template <class Allocator>
+class StackFrame {
+public:
+    explicit StackFrame(Allocator & allocator) : allocator_(allocator), marker_(allocator.pushFrame()) {}
+
+    StackFrame(const StackFrame &) = delete;
+    StackFrame & operator=(const StackFrame &) = delete;
+
+    ~StackFrame() {
+        allocator_.popFrame(marker_);
+    }
+
+private:
+    Allocator & allocator_;
+    typename Allocator::Marker marker_;
+};
+} // namespace StackAllocator
+} // namespace AllocatorBuilder
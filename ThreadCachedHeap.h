@@ -0,0 +1,223 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+#include "PageHeap.h"
+#include "SizeClassAllocator.h"
+#include "SizeClasses.h"
+#include "ThreadCachingAllocator.h"
+
+namespace AllocatorBuilder {
+namespace ThreadCachedHeap {
+// Process-wide untyped heap composed from the builder's components: a per-thread ThreadCache, then a central
+// SizeClassHeap whose slabs are mapped by PageHeap, and a PageHeap::LargeSpanCache for anything above kMaxSmallSize. A PageMap
+// tells unsized deallocation which of the two a bare pointer came from; sized deallocation does not need it.
+//
+// Everything is static so it can sit under malloc or operator new. Tag gives each user (MallocReplacement.cpp,
+// GlobalNewDelete.cpp) its own heap. Nothing here calls malloc: the central heap is placement-new'd on first use and
+// never destroyed, the thread cache is a trivial thread_local (no TLS constructor or atexit registration; build with
+// -ftls-model=initial-exec) and the only thread exit hook is a pthread key, which glibc stores without allocating.
+template <class Tag>
+class ThreadCachedHeap {
+public:
+    // nullptr on failure. alignment must be a power of 2.
+    static void * allocate(size_t size, size_t alignment) {
+        size_t size_class = AlignedSizeClass(size, alignment);
+        if (size_class < SizeClasses::kNumSizeClasses) {
+            return allocateSmall(size_class);
+        }
+        return large_spans_.allocate(size, alignment);
+    }
+
+    static void deallocate(void * p) {
+        uint8_t entry = page_map_.get(p);
+        if (entry != 0) {
+            deallocateSmall(p, entry - 1);
+        } else {
+            large_spans_.deallocate(p);
+        }
+    }
+
+    // size and alignment must be the ones p was allocated with, in exchange the size class is computed rather than
+    // looked up
+    static void deallocate(void * p, size_t size, size_t alignment) {
+        size_t size_class = AlignedSizeClass(size, alignment);
+        if (size_class < SizeClasses::kNumSizeClasses) {
+            deallocateSmall(p, size_class);
+        } else {
+            large_spans_.deallocate(p);
+        }
+    }
+
+    static size_t usableSize(void * p) {
+        uint8_t entry = page_map_.get(p);
+        return entry != 0 ? SizeClasses::ClassToSize(entry - 1) : PageHeap::LargeUsableSize(p);
+    }
+
+    // Slab memory and reused large spans can hold stale data, fresh mappings cannot
+    static bool mayBeDirty(void * p) {
+        return page_map_.get(p) != 0 || !PageHeap::LargeIsZeroed(p);
+    }
+
+    // For pthread_atfork, so the child does not inherit a locked heap
+    static void lockForFork() {
+        central_mutex_.lock();
+        large_spans_.lock();
+    }
+
+    static void unlockAfterFork() {
+        large_spans_.unlock();
+        central_mutex_.unlock();
+    }
+
+    // Smallest size class whose objects are all aligned to alignment, or kNumSizeClasses if there is none. Objects sit
+    // at slab + kSlabHeaderSize + k * class_size and slabs are page aligned, so a class works when its size is a
+    // multiple of alignment.
+    //
+    // Nothing above kSlabHeaderSize can be met that way, so every request aligned past 64 bytes, however small, takes
+    // at least a page from the large span cache. That is a mutex and a free list pop rather than a mapping, but the
+    // memory overhead makes this heap a poor fit for many small over-aligned objects.
+    static size_t AlignedSizeClass(size_t size, size_t alignment) {
+        if (size > SizeClasses::kMaxSmallSize || alignment > SizeClasses::kSlabHeaderSize) {
+            return SizeClasses::kNumSizeClasses;
+        } else if (alignment <= kNaturalAlignment) {
+            // Skips the modulo on the default path of malloc and operator new
+            return SizeClasses::SizeToClass(std::max(size, alignment));
+        }
+
+        size_t size_class = SizeClasses::SizeToClass(std::max(size, alignment));
+        while (size_class < SizeClasses::kNumSizeClasses && SizeClasses::ClassToSize(size_class) % alignment != 0) {
+            ++size_class;
+        }
+        return size_class;
+    }
+
+private:
+    // Every size class from 16 bytes up is a multiple of 16, and the 8 byte class is only picked for alignment <= 8
+    static const constexpr size_t kNaturalAlignment = 16;
+    static_assert(SizeClasses::ClassToSize(1) == kNaturalAlignment, "Size classes are no longer multiples of kNaturalAlignment");
+
+    static PageHeap::PageMap page_map_;
+    static PageHeap::LargeSpanCache large_spans_;
+
+    using CentralHeap = SizeClassAllocator::detail::SizeClassHeap<PageHeap::SlabSource<ThreadCachedHeap::page_map_>>;
+    using ThreadCache = ThreadCachingAllocator::detail::ThreadCache<SizeClasses::kNumSizeClasses>;
+
+    struct ThreadState {
+        bool registered;
+        bool torn_down; // Set once the thread's exit hook ran, later calls bypass the cache
+        ThreadCache cache;
+    };
+
+    // Objects moved between a thread cache and the central heap at once, about 16 KiB worth
+    static size_t BatchSize(size_t size_class) {
+        return std::min<size_t>(64, std::max<size_t>(1, 16 * 1024 / SizeClasses::ClassToSize(size_class)));
+    }
+
+    static CentralHeap & centralHeap() {
+        // Called with central_mutex_ held
+        if (central_heap_ == nullptr) {
+            central_heap_ = ::new(central_heap_storage_) CentralHeap();
+        }
+        return *central_heap_;
+    }
+
+    static void onThreadExit(void * arg) {
+        ThreadState & state = *reinterpret_cast<ThreadState *>(arg);
+        std::lock_guard<std::mutex> lock(central_mutex_);
+        state.cache.flushAll(centralHeap());
+        state.torn_down = true;
+    }
+
+    static void createThreadKey() {
+        pthread_key_create(&thread_key_, onThreadExit);
+    }
+
+    static void * allocateSmall(size_t size_class) {
+        void * p = thread_state_.cache.pop(size_class);
+        if (p != nullptr) {
+            return p;
+        }
+        return allocateSmallSlow(size_class);
+    }
+
+    // Both paths fill the cache, so both have to make sure it is flushed when the thread exits
+    static void ensureRegistered(ThreadState & state) {
+        if (!state.registered && !state.torn_down) {
+            state.registered = true;
+            pthread_once(&thread_key_once_, createThreadKey);
+            pthread_setspecific(thread_key_, &state);
+        }
+    }
+
+    static void * allocateSmallSlow(size_t size_class) {
+        ThreadState & state = thread_state_;
+        ensureRegistered(state);
+
+        std::lock_guard<std::mutex> lock(central_mutex_);
+        if (state.torn_down) {
+            return centralHeap().allocate(size_class);
+        }
+
+        if (state.cache.refill(centralHeap(), size_class, BatchSize(size_class)) == 0) {
+            return nullptr;
+        }
+        return state.cache.pop(size_class);
+    }
+
+    static void deallocateSmall(void * p, size_t size_class) {
+        ThreadState & state = thread_state_;
+        if (state.torn_down) {
+            std::lock_guard<std::mutex> lock(central_mutex_);
+            centralHeap().deallocate(p, size_class);
+            return;
+        }
+
+        ensureRegistered(state);
+        if (state.cache.push(p, size_class) > 2 * BatchSize(size_class)) {
+            std::lock_guard<std::mutex> lock(central_mutex_);
+            state.cache.flush(centralHeap(), size_class, BatchSize(size_class));
+        }
+    }
+
+    alignas(CentralHeap) static char central_heap_storage_[sizeof(CentralHeap)];
+    static CentralHeap * central_heap_;
+    static std::mutex central_mutex_;
+
+    static pthread_once_t thread_key_once_;
+    static pthread_key_t thread_key_;
+
+    static thread_local ThreadState thread_state_;
+};
+
+template <class Tag>
+PageHeap::PageMap ThreadCachedHeap<Tag>::page_map_;
+
+template <class Tag>
+PageHeap::LargeSpanCache ThreadCachedHeap<Tag>::large_spans_;
+
+template <class Tag>
+alignas(typename ThreadCachedHeap<Tag>::CentralHeap) char ThreadCachedHeap<Tag>::central_heap_storage_[sizeof(CentralHeap)];
+
+template <class Tag>
+typename ThreadCachedHeap<Tag>::CentralHeap * ThreadCachedHeap<Tag>::central_heap_ = nullptr;
+
+template <class Tag>
+std::mutex ThreadCachedHeap<Tag>::central_mutex_;
+
+template <class Tag>
+pthread_once_t ThreadCachedHeap<Tag>::thread_key_once_ = PTHREAD_ONCE_INIT;
+
+template <class Tag>
+pthread_key_t ThreadCachedHeap<Tag>::thread_key_;
+
+template <class Tag>
+thread_local typename ThreadCachedHeap<Tag>::ThreadState ThreadCachedHeap<Tag>::thread_state_;
+} // namespace ThreadCachedHeap
+} // namespace AllocatorBuilder
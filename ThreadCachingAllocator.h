@@ -3,17 +3,259 @@
 
 #include <stdlib.h>
 
+#include <atomic>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <new>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
+
+#include "SharedState.h"
 
 namespace AllocatorBuilder {
 namespace ThreadCachingAllocator {
 namespace detail {
+// Per-thread stash of free objects for each of NumClasses size classes, so the common case never touches shared state.
+// Refills and flushes move objects to and from a central heap in batches, under whatever lock the caller holds.
+//
+// Trivially constructible and destructible on purpose: a zero-initialized thread_local ThreadCache needs no TLS
+// constructor or destructor registration, which may itself allocate while malloc is being bootstrapped.
+template <size_t NumClasses>
 class ThreadCache {
+public:
+    void * pop(size_t size_class) {
+        FreeList & list = lists_[size_class];
+        FreeObject * object = list.head;
+        if (object != nullptr) {
+            list.head = object->next;
+            --list.length;
+        }
+        return object;
+    }
+
+    // Returns the new number of cached objects of size_class
+    size_t push(void * p, size_t size_class) {
+        FreeList & list = lists_[size_class];
+        FreeObject * object = reinterpret_cast<FreeObject *>(p);
+        object->next = list.head;
+        list.head = object;
+        return ++list.length;
+    }
+
+    size_t length(size_t size_class) const {
+        return lists_[size_class].length;
+    }
+
+    // Moves up to count objects from central_heap.allocate(size_class) into the cache, returns how many it got
+    template <class CentralHeap>
+    size_t refill(CentralHeap & central_heap, size_t size_class, size_t count) {
+        size_t num_refilled = 0;
+        for (; num_refilled < count; ++num_refilled) {
+            void * p = central_heap.allocate(size_class);
+            if (p == nullptr) {
+                break;
+            }
+            push(p, size_class);
+        }
+        return num_refilled;
+    }
+
+    // Hands up to count objects of size_class back to central_heap.deallocate
+    template <class CentralHeap>
+    void flush(CentralHeap & central_heap, size_t size_class, size_t count) {
+        for (size_t k = 0; k < count; ++k) {
+            void * p = pop(size_class);
+            if (p == nullptr) {
+                break;
+            }
+            central_heap.deallocate(p, size_class);
+        }
+    }
+
+    template <class CentralHeap>
+    void flushAll(CentralHeap & central_heap) {
+        for (size_t size_class = 0; size_class < NumClasses; ++size_class) {
+            flush(central_heap, size_class, lists_[size_class].length);
+        }
+    }
+
+private:
+    struct FreeObject {
+        FreeObject * next;
+    };
+
+    struct FreeList {
+        FreeObject * head;
+        size_t length;
+    };
+
+    FreeList lists_[NumClasses];
+};
+
+// One thread's cache for one owner, usually a ThreadCachingState. Each thread keeps a list of its entries and each
+// owner a list of the entries filled from it, so whichever of the two goes first can flush the cache into the owner.
+struct ThreadCacheEntry {
+    std::atomic<void *> owner;                         // nullptr once the owner is gone
+    void (*flush_all)(void * owner, ThreadCacheEntry & entry); // Also unlinks entry from the owner's list
+    ThreadCacheEntry * next_in_thread;
+    ThreadCacheEntry * prev_in_owner;                  // Owner's list, under RegistryMutex()
+    ThreadCacheEntry * next_in_owner;
+    ThreadCache<1> cache;
+};
+
+// Guards every owner's list and the handover between owners and exiting threads
+inline std::mutex & RegistryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+inline void UnlinkFromOwner(ThreadCacheEntry * & owner_entries, ThreadCacheEntry * entry) {
+    if (entry->prev_in_owner != nullptr) {
+        entry->prev_in_owner->next_in_owner = entry->next_in_owner;
+    } else {
+        owner_entries = entry->next_in_owner;
+    }
+    if (entry->next_in_owner != nullptr) {
+        entry->next_in_owner->prev_in_owner = entry->prev_in_owner;
+    }
+}
+
+// The calling thread's entries. A single thread_local for every owner, where a pthread key per owner would run out
+// after PTHREAD_KEYS_MAX owners.
+struct ThreadCacheEntries {
+    ThreadCacheEntry * head = nullptr;
+    ThreadCacheEntry * last_used = nullptr;
+
+    ~ThreadCacheEntries() {
+        std::lock_guard<std::mutex> lock(RegistryMutex());
+        while (head != nullptr) {
+            ThreadCacheEntry * entry = head;
+            head = entry->next_in_thread;
+
+            void * owner = entry->owner.load(std::memory_order_relaxed);
+            if (owner != nullptr) {
+                entry->flush_all(owner, *entry);
+            }
+            delete entry;
+        }
+    }
+};
+
+inline ThreadCacheEntries & CurrentThreadCacheEntries() {
+    static thread_local ThreadCacheEntries entries;
+    return entries;
+}
+
+// Per value type state of a ThreadCachingAllocator: the backing allocator and each thread's cache of single objects.
+// Objects smaller than a pointer cannot hold a free list link and are never cached.
+//
+// A thread's cache is handed back to the backing allocator when the thread exits or when the state goes away, whichever
+// comes first. The state must not be destroyed while another thread is still using it.
+template <class T, class BackingAllocator>
+class ThreadCachingState {
+public:
+    static const constexpr bool kCacheable = sizeof(T) >= sizeof(void *);
+    static const constexpr size_t kMaxCachedObjects = 64;
 
+    ThreadCachingState() = default;
+
+    ThreadCachingState(const ThreadCachingState &) = delete;
+    ThreadCachingState & operator=(const ThreadCachingState &) = delete;
+
+    // The entries stay on their threads' lists, the threads free them
+    ~ThreadCachingState() {
+        std::lock_guard<std::mutex> lock(RegistryMutex());
+        for (ThreadCacheEntry * entry = entries_; entry != nullptr; entry = entry->next_in_owner) {
+            entry->cache.flushAll(*this);
+            entry->owner.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    T * allocate(std::size_t n) {
+        if (kCacheable && n == 1) {
+            void * p = threadCache().pop(0);
+            if (p != nullptr) {
+                return reinterpret_cast<T *>(p);
+            }
+        }
+        return allocator_.allocate(n);
+    }
+
+    void deallocate(T * p, std::size_t n) {
+        if (kCacheable && n == 1) {
+            ThreadCache<1> & cache = threadCache();
+            if (cache.push(p, 0) > kMaxCachedObjects) {
+                cache.flush(*this, 0, kMaxCachedObjects / 2);
+            }
+            return;
+        }
+        allocator_.deallocate(p, n);
+    }
+
+    // CentralHeap interface for ThreadCache::flush
+    void deallocate(void * p, size_t size_class) {
+        allocator_.deallocate(reinterpret_cast<T *>(p), 1);
+    }
+
+private:
+    // Called with RegistryMutex() held by an exiting thread
+    static void flushAll(void * owner, ThreadCacheEntry & entry) {
+        ThreadCachingState * state = reinterpret_cast<ThreadCachingState *>(owner);
+        entry.cache.flushAll(*state);
+        UnlinkFromOwner(state->entries_, &entry);
+    }
+
+    ThreadCache<1> & threadCache() {
+        ThreadCacheEntries & entries = CurrentThreadCacheEntries();
+        if (entries.last_used != nullptr && entries.last_used->owner.load(std::memory_order_relaxed) == this) {
+            return entries.last_used->cache;
+        }
+
+        for (ThreadCacheEntry * entry = entries.head; entry != nullptr; entry = entry->next_in_thread) {
+            if (entry->owner.load(std::memory_order_relaxed) == this) {
+                entries.last_used = entry;
+                return entry->cache;
+            }
+        }
+        return addEntry(entries).cache;
+    }
+
+    ThreadCacheEntry & addEntry(ThreadCacheEntries & entries) {
+        ThreadCacheEntry * entry = new ThreadCacheEntry();
+        entry->owner.store(this, std::memory_order_relaxed);
+        entry->flush_all = &ThreadCachingState::flushAll;
+
+        std::lock_guard<std::mutex> lock(RegistryMutex());
+
+        // Drop entries of states that are gone while no state can be clearing them
+        for (ThreadCacheEntry ** link = &entries.head; *link != nullptr;) {
+            ThreadCacheEntry * dead = *link;
+            if (dead->owner.load(std::memory_order_relaxed) == nullptr) {
+                *link = dead->next_in_thread;
+                delete dead;
+            } else {
+                link = &dead->next_in_thread;
+            }
+        }
+
+        entry->next_in_thread = entries.head;
+        entries.head = entry;
+        entries.last_used = entry;
+
+        entry->prev_in_owner = nullptr;
+        entry->next_in_owner = entries_;
+        if (entries_ != nullptr) {
+            entries_->prev_in_owner = entry;
+        }
+        entries_ = entry;
+        return *entry;
+    }
+
+    BackingAllocator allocator_;
+    ThreadCacheEntry * entries_ = nullptr; // Every thread's entry for this state, under RegistryMutex()
 };
 } // namespace detail
 
@@ -29,19 +271,21 @@ public:
     using const_reference = const T&;
     using size_type = std::size_t;
     using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
     using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
 
-    template<class U, class OtherBackingAllocator, size_t OtherNumArenas>
+    template <class U>
     struct rebind {
-        typedef ThreadCachingAllocator<U, OtherBackingAllocator, OtherNumArenas> other;
+        typedef ThreadCachingAllocator<U, typename std::allocator_traits<BackingAllocator>::template rebind_alloc<U>, NumArenas> other;
     };
 
-    using is_always_equal = std::true_type;
+    using is_always_equal = std::false_type;
 
     // custom allocator traits
     using thread_safe = std::true_type;
 
-//    static_assert(std::is_same<typename BackingAllocator::thread_safe, std::true_type>::value, "Backing allocator must be lock-safe");
+    static_assert(std::is_same<typename BackingAllocator::thread_safe, std::true_type>::value, "Backing allocator must be lock-safe");
 
     pointer address(reference x) const noexcept {
         return std::addressof(x);
@@ -51,12 +295,11 @@ public:
         return std::addressof(x);
     }
 
-    ThreadCachingAllocator() {
-//        int res = pthread_key_create(thread_cache_key_);
-//        if (res != 0) {
-//            throw std::runtime_error("Could not create pthread thread-specific-data key");
-//        }
-    }
+    ThreadCachingAllocator() : ThreadCachingAllocator(SharedState::MakeStateGroup()) {}
+
+    template <class U, class OtherBackingAllocator>
+    ThreadCachingAllocator(const ThreadCachingAllocator<U, OtherBackingAllocator, NumArenas> & other)
+        : ThreadCachingAllocator(other.state_group_) {}
 
     pointer allocate(std::size_t n, const void * hint) {
         // purposefully ignore hint
@@ -64,12 +307,11 @@ public:
     }
 
     pointer allocate(std::size_t n) {
-        // TODO
-        return nullptr;
+        return state_->allocate(n);
     }
 
     void deallocate(pointer p, std::size_t n) {
-        // TODO
+        state_->deallocate(p, n);
     }
 
     size_type max_size() const noexcept {
@@ -85,10 +327,28 @@ public:
     void destroy(U * p) {
         p->~U();
     }
+
+    template <class U, class OtherBackingAllocator>
+    bool operator==(const ThreadCachingAllocator<U, OtherBackingAllocator, NumArenas> & other) const noexcept {
+        return state_group_ == other.state_group_;
+    }
+
+    template <class U, class OtherBackingAllocator>
+    bool operator!=(const ThreadCachingAllocator<U, OtherBackingAllocator, NumArenas> & other) const noexcept {
+        return !(*this == other);
+    }
+
 private:
-    BackingAllocator allocator_;
+    template <class U, class OtherBackingAllocator, size_t OtherNumArenas>
+    friend class ThreadCachingAllocator;
+
+    using State = detail::ThreadCachingState<T, BackingAllocator>;
+
+    explicit ThreadCachingAllocator(std::shared_ptr<SharedState::StateGroup> state_group)
+        : state_group_(std::move(state_group)), state_(&state_group_->template get<State>()) {}
 
-    pthread_key_t thread_cache_key_;
+    std::shared_ptr<SharedState::StateGroup> state_group_;
+    State * state_;
 };
 } // namespace ThreadCachingAllocator
 } // namespace AllocatorBuilder
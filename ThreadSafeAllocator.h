@@ -1,10 +1,15 @@
 #pragma once
 
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <type_traits>
+#include <utility>
 
 namespace AllocatorBuilder {
 namespace ThreadSafeAllocator {
-// Turns any allocator into a thread-safe allocator by serializing all accesses
+// Turns any allocator into a thread-safe allocator by serializing all accesses. The mutex is shared by copies and
+// rebinds, just like the state of the base allocator it protects.
 template <class BaseAllocator>
 class ThreadSafeAllocator {
 public:
@@ -16,20 +21,27 @@ public:
     using const_reference = typename BaseAllocator::const_reference;
     using size_type = typename BaseAllocator::size_type;
     using difference_type = typename BaseAllocator::difference_type;
-    using propagate_on_container_move_assignment = typename BaseAllocator::propagate_on_container_move_assignment;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
 
-//    template<class U>
-//    using rebind = typename BaseAllocator::template rebind<U>;
+    template <class U>
+    struct rebind {
+        typedef ThreadSafeAllocator<typename std::allocator_traits<BaseAllocator>::template rebind_alloc<U>> other;
+    };
 
-    using is_always_equal = typename BaseAllocator::is_always_equal;
+    using is_always_equal = std::false_type;
 
     // custom allocator traits
     using thread_safe = std::true_type;
 
-    template <class... Args>
-    ThreadSafeAllocator(Args&&... args) : allocator_(std::forward<Args>(args)...) {}
+    // There is deliberately no constructor from a BaseAllocator: base allocators share their state with their copies,
+    // so two wrappers of copies would guard one heap with two mutexes
+    ThreadSafeAllocator() : mutex_(std::make_shared<std::mutex>()) {}
 
-    // TODO copy and move need to be thread-safe
+    // Copying only touches the handles, the shared state itself is not read
+    template <class OtherBaseAllocator>
+    ThreadSafeAllocator(const ThreadSafeAllocator<OtherBaseAllocator> & other) : mutex_(other.mutex_), allocator_(other.allocator_) {}
 
     pointer address(reference x) const noexcept {
         return std::addressof(x);
@@ -45,13 +57,13 @@ public:
     }
 
     pointer allocate(std::size_t n) {
-        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<std::mutex> lock(*mutex_);
         return allocator_.allocate(n);
     }
 
     void deallocate(pointer p, std::size_t n) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        allocator_.free(p);
+        std::lock_guard<std::mutex> lock(*mutex_);
+        allocator_.deallocate(p, n);
     }
 
     size_type max_size() const noexcept {
@@ -68,8 +80,21 @@ public:
         p->~U();
     }
 
+    template <class OtherBaseAllocator>
+    bool operator==(const ThreadSafeAllocator<OtherBaseAllocator> & other) const noexcept {
+        return mutex_ == other.mutex_;
+    }
+
+    template <class OtherBaseAllocator>
+    bool operator!=(const ThreadSafeAllocator<OtherBaseAllocator> & other) const noexcept {
+        return !(*this == other);
+    }
+
 private:
-    std::mutex mutex_;
+    template <class OtherBaseAllocator>
+    friend class ThreadSafeAllocator;
+
+    std::shared_ptr<std::mutex> mutex_;
     BaseAllocator allocator_;
 };
 } // namespace ThreadSafeAllocator
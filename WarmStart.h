@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <ostream>
+
+namespace AllocatorBuilder {
+namespace WarmStart {
+// Allocators hand out memory the kernel has not backed yet, so the first request to land on each page pays for a page
+// fault. Reserving at startup moves that cost to boot time: reserve() on an allocator creates its regions and slabs up
+// front and, depending on ReserveOptions, faults them in and locks them.
+struct ReserveOptions {
+    bool prefault = true; // Touch every page now instead of on first use
+    bool lock = false;    // mlock() the memory so it is never paged out, needs a large enough RLIMIT_MEMLOCK
+};
+
+// What a reservation did and what it cost, so boot time can be traded against first-request latency
+struct ReservationReport {
+    size_t bytes_reserved = 0;
+    size_t pages_prefaulted = 0;
+    size_t bytes_locked = 0;
+    size_t bytes_lock_failed = 0; // mlock() refused (usually RLIMIT_MEMLOCK), or the memory shared a page with other data
+    double milliseconds = 0.0;
+
+    ReservationReport & operator+=(const ReservationReport & other) {
+        bytes_reserved += other.bytes_reserved;
+        pages_prefaulted += other.pages_prefaulted;
+        bytes_locked += other.bytes_locked;
+        bytes_lock_failed += other.bytes_lock_failed;
+        milliseconds += other.milliseconds;
+        return *this;
+    }
+};
+
+inline std::ostream & operator<<(std::ostream & os, const ReservationReport & report) {
+    os << "reserved=" << report.bytes_reserved << " prefaulted_pages=" << report.pages_prefaulted
+       << " locked=" << report.bytes_locked;
+    if (report.bytes_lock_failed != 0) {
+        os << " lock_failed=" << report.bytes_lock_failed;
+    }
+    return os << " time=" << report.milliseconds << " ms";
+}
+
+inline double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Accounts for [mem, mem + size) in report and prepares it as options ask. The region may already hold data.
+inline void PrepareRegion(void * mem, size_t size, const ReserveOptions & options, ReservationReport & report) {
+    report.bytes_reserved += size;
+
+    if (options.prefault) {
+        // Writing back what is there faults in a private page, where a read would only map the shared zero page
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+        volatile char * first = reinterpret_cast<volatile char *>(mem);
+        volatile char * end = first + size;
+        volatile char * page = reinterpret_cast<volatile char *>(reinterpret_cast<uintptr_t>(mem) / page_size * page_size);
+
+        for (; page < end; page += page_size) {
+            volatile char * p = page < first ? first : page;
+            *p = *p;
+            ++report.pages_prefaulted;
+        }
+    }
+
+    if (options.lock) {
+        // mlock() faults the pages in as well, so this covers prefault == false too
+        if (mlock(mem, size) == 0) {
+            report.bytes_locked += size;
+        } else {
+            report.bytes_lock_failed += size;
+        }
+    }
+}
+
+// The whole pages inside [mem, mem + size). mlock() and munlock() act on whole pages, so memory that may share its first
+// or last page with unrelated data (anything not from a page allocator) must only lock and unlock these.
+struct PageSpan {
+    void * begin;
+    size_t size;
+};
+
+inline PageSpan InteriorPages(void * mem, size_t size) {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(mem) + page_size - 1) / page_size * page_size;
+    uintptr_t end = (reinterpret_cast<uintptr_t>(mem) + size) / page_size * page_size;
+    return PageSpan{reinterpret_cast<void *>(begin), end > begin ? end - begin : 0};
+}
+
+// Like PrepareRegion() with options.lock, but only locks InteriorPages(), the rest is reported as lock_failed. Returns
+// whether anything was locked.
+inline bool LockInteriorPages(void * mem, size_t size, ReservationReport & report) {
+    PageSpan pages = InteriorPages(mem, size);
+    if (pages.size != 0 && mlock(pages.begin, pages.size) == 0) {
+        report.bytes_locked += pages.size;
+        report.bytes_lock_failed += size - pages.size;
+        return true;
+    }
+    report.bytes_lock_failed += size;
+    return false;
+}
+
+inline void UnlockInteriorPages(void * mem, size_t size) {
+    PageSpan pages = InteriorPages(mem, size);
+    if (pages.size != 0) {
+        munlock(pages.begin, pages.size);
+    }
+}
+} // namespace WarmStart
+} // namespace AllocatorBuilder
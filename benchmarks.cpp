@@ -0,0 +1,376 @@
+#include "AlignedAllocator.h"
+#include "BuddyAllocator.h"
+#include "CacheLineIsolatedAllocator.h"
+#include "EpochReclaimingAllocator.h"
+#include "GuardedSamplingAllocator.h"
+#include "Mallocator.h"
+#include "SizeClassAllocator.h"
+#include "SlabAllocator.h"
+#include "StackAllocator.h"
+#include "ThreadCachingAllocator.h"
+#include "ThreadSafeAllocator.h"
+#include "WarmStart.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace AllocatorBuilder;
+
+namespace {
+template <class Function>
+double TimeMilliseconds(Function && function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void Report(const std::string & name, double milliseconds) {
+    std::cout << "  " << name << ": " << milliseconds << " ms" << std::endl;
+}
+
+// Every thread hammers its own counter. The counters are allocated back to back from the main thread, which is where
+// false sharing hurts: a packing allocator puts them all in one cache line.
+template <class Allocator>
+double FalseSharingBenchmark(size_t num_threads, size_t num_increments) {
+    using Counter = std::atomic<uint64_t>;
+
+    Allocator allocator;
+    std::vector<Counter *> counters;
+    for (size_t k = 0; k < num_threads; ++k) {
+        Counter * counter = allocator.allocate(1);
+        allocator.construct(counter, 0);
+        counters.push_back(counter);
+    }
+
+    double milliseconds = TimeMilliseconds([&]() {
+        std::vector<std::thread> threads;
+        for (Counter * counter : counters) {
+            threads.emplace_back([counter, num_increments]() {
+                for (size_t k = 0; k < num_increments; ++k) {
+                    counter->fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        }
+
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    });
+
+    for (Counter * counter : counters) {
+        allocator.destroy(counter);
+        allocator.deallocate(counter, 1);
+    }
+
+    return milliseconds;
+}
+
+void RunFalseSharingBenchmarks() {
+    using Counter = std::atomic<uint64_t>;
+
+    const size_t num_threads = std::max(2u, std::min(8u, std::thread::hardware_concurrency()));
+    const size_t num_increments = 20000000;
+
+    std::cout << "False sharing (" << num_threads << " threads, " << num_increments << " increments each)" << std::endl;
+    Report("SizeClassAllocator", FalseSharingBenchmark<SizeClassAllocator::SizeClassAllocator<Counter, Mallocator::Mallocator>>(num_threads, num_increments));
+    Report("CacheLineIsolatedAllocator<64>", FalseSharingBenchmark<CacheLineIsolatedAllocator::CacheLineIsolatedAllocator<Counter, Mallocator::Mallocator>>(num_threads, num_increments));
+    Report("CacheLineIsolatedAllocator<128>", FalseSharingBenchmark<CacheLineIsolatedAllocator::CacheLineIsolatedAllocator<Counter, Mallocator::Mallocator, CacheLineIsolatedAllocator::kDestructiveInterferenceSize>>(num_threads, num_increments));
+}
+
+// Plain new/delete churn through the default allocator, compare the benchmarks and benchmarks_newdelete binaries
+void RunNewDeleteBenchmarks() {
+    const size_t num_operations = 1000000;
+
+    std::cout << "new/delete (" << num_operations << " operations)" << std::endl;
+    Report("std::map<int, int> insert/erase", TimeMilliseconds([num_operations]() {
+        std::map<int, int> map;
+        for (size_t k = 0; k < num_operations; ++k) {
+            map.emplace(static_cast<int>(k * 2654435761u % num_operations), static_cast<int>(k));
+        }
+        for (size_t k = 0; k < num_operations; ++k) {
+            map.erase(static_cast<int>(k));
+        }
+    }));
+
+    Report("new char[1..1024]/delete[]", TimeMilliseconds([num_operations]() {
+        std::vector<std::unique_ptr<char[]>> buffers(1024);
+        for (size_t k = 0; k < num_operations; ++k) {
+            buffers[k * 7 % buffers.size()].reset(new char[1 + k * 2654435761u % 1024]);
+        }
+    }));
+}
+
+// Node churn through each allocator. Allocator is instantiated for int and rebound by the containers, and the two
+// lists share one allocator so splicing between them is legal.
+template <class Allocator>
+void RunContainerBenchmarks(const std::string & name, size_t num_elements) {
+    using MapAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<const int, int>>;
+    using Map = std::map<int, int, std::less<int>, MapAllocator>;
+    using List = std::list<int, Allocator>;
+    using UnorderedMap = std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, MapAllocator>;
+
+    std::cout << name << " (" << num_elements << " elements)" << std::endl;
+
+    Report("map insert/erase", TimeMilliseconds([num_elements]() {
+        Map map;
+        for (size_t k = 0; k < num_elements; ++k) {
+            map.emplace(static_cast<int>(k * 2654435761u % num_elements), static_cast<int>(k));
+        }
+        for (size_t k = 0; k < num_elements; ++k) {
+            map.erase(static_cast<int>(k));
+        }
+    }));
+
+    Report("list push/splice/pop", TimeMilliseconds([num_elements]() {
+        Allocator allocator;
+        List from(allocator);
+        List to(allocator);
+        for (size_t k = 0; k < num_elements; ++k) {
+            from.push_back(static_cast<int>(k));
+        }
+        while (!from.empty()) {
+            to.splice(from.front() % 2 == 0 ? to.begin() : to.end(), from, from.begin());
+        }
+        while (!to.empty()) {
+            to.pop_front();
+        }
+    }));
+
+    Report("unordered_map insert with rehash", TimeMilliseconds([num_elements]() {
+        UnorderedMap map;
+        for (size_t k = 0; k < num_elements; ++k) {
+            map.emplace(static_cast<int>(k), static_cast<int>(k));
+        }
+    }));
+}
+
+void RunAllContainerBenchmarks() {
+    // The slab allocator searches its slab lists on every deallocation, so keep the element count modest
+    const size_t num_elements = 20000;
+
+    RunContainerBenchmarks<std::allocator<int>>("std::allocator", num_elements);
+    RunContainerBenchmarks<Mallocator::Mallocator<int>>("Mallocator", num_elements);
+    RunContainerBenchmarks<AlignedAllocator::AlignedAllocator<int, 64>>("AlignedAllocator<64>", num_elements);
+    RunContainerBenchmarks<SlabAllocator::SlabAllocator<int, Mallocator::Mallocator>>("SlabAllocator", num_elements);
+    RunContainerBenchmarks<BuddyAllocator::BuddyAllocator<int, 32, 8 * 1024 * 1024>>("BuddyAllocator", num_elements);
+    RunContainerBenchmarks<SizeClassAllocator::SizeClassAllocator<int, Mallocator::Mallocator>>("SizeClassAllocator", num_elements);
+    RunContainerBenchmarks<GuardedSamplingAllocator::GuardedSamplingAllocator<SizeClassAllocator::SizeClassAllocator<int, Mallocator::Mallocator>>>("GuardedSamplingAllocator<SizeClassAllocator>", num_elements);
+    RunContainerBenchmarks<CacheLineIsolatedAllocator::CacheLineIsolatedAllocator<int, Mallocator::Mallocator>>("CacheLineIsolatedAllocator", num_elements);
+    RunContainerBenchmarks<ThreadSafeAllocator::ThreadSafeAllocator<SizeClassAllocator::SizeClassAllocator<int, Mallocator::Mallocator>>>("ThreadSafeAllocator<SizeClassAllocator>", num_elements);
+    RunContainerBenchmarks<ThreadCachingAllocator::ThreadCachingAllocator<int, Mallocator::Mallocator<int>>>("ThreadCachingAllocator", num_elements);
+}
+
+// Lock-free stack whose pop() retires nodes through an EpochReclaimingAllocator rather than leaking them
+template <class Allocator>
+class TreiberStack {
+public:
+    TreiberStack() = default;
+
+    TreiberStack(const TreiberStack &) = delete;
+    TreiberStack & operator=(const TreiberStack &) = delete;
+
+    ~TreiberStack() {
+        int value;
+        while (pop(value)) {
+        }
+    }
+
+    void push(int value) {
+        Node * node = allocator_.allocate(1);
+        allocator_.construct(node, Node{value, head_.load(std::memory_order_relaxed)});
+        while (!head_.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    bool pop(int & value) {
+        EpochReclaimingAllocator::EpochGuard<NodeAllocator> guard(allocator_);
+
+        Node * head = head_.load(std::memory_order_acquire);
+        while (head != nullptr && !head_.compare_exchange_weak(head, head->next, std::memory_order_acquire, std::memory_order_acquire)) {
+        }
+
+        if (head == nullptr) {
+            return false;
+        }
+
+        value = head->value;
+        allocator_.retire(head);
+        return true;
+    }
+
+private:
+    struct Node {
+        int value;
+        Node * next;
+    };
+
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+
+    std::atomic<Node *> head_{nullptr};
+    NodeAllocator allocator_;
+};
+
+template <class Allocator>
+double TreiberStackBenchmark(size_t num_threads, size_t num_operations) {
+    TreiberStack<Allocator> stack;
+
+    return TimeMilliseconds([&]() {
+        std::vector<std::thread> threads;
+        for (size_t k = 0; k < num_threads; ++k) {
+            threads.emplace_back([&stack, num_operations]() {
+                int value;
+                for (size_t k = 0; k < num_operations; ++k) {
+                    stack.push(static_cast<int>(k));
+                    stack.push(static_cast<int>(k));
+                    stack.pop(value);
+                    stack.pop(value);
+                }
+            });
+        }
+
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    });
+}
+
+void RunEpochReclamationBenchmarks() {
+    const size_t num_threads = std::max(2u, std::min(8u, std::thread::hardware_concurrency()));
+    const size_t num_operations = 200000;
+
+    std::cout << "Treiber stack push/pop (" << num_threads << " threads, " << num_operations << " iterations each)" << std::endl;
+    Report("EpochReclaimingAllocator<Mallocator>", TreiberStackBenchmark<EpochReclaimingAllocator::EpochReclaimingAllocator<Mallocator::Mallocator<int>>>(num_threads, num_operations));
+    Report("EpochReclaimingAllocator<ThreadSafeAllocator<SizeClassAllocator>>", TreiberStackBenchmark<EpochReclaimingAllocator::EpochReclaimingAllocator<ThreadSafeAllocator::ThreadSafeAllocator<SizeClassAllocator::SizeClassAllocator<int, Mallocator::Mallocator>>>>(num_threads, num_operations));
+}
+
+// A recursive walk that takes a scratch buffer per level and frees it on the way back up, strictly nested
+template <class Allocator>
+int NestedScratch(Allocator & allocator, size_t depth) {
+    if (depth == 0) {
+        return 0;
+    }
+
+    size_t n = 16 + depth * 24;
+    int * scratch = allocator.allocate(n);
+    scratch[0] = static_cast<int>(depth);
+    scratch[n - 1] = NestedScratch(allocator, depth - 1);
+    int result = scratch[0] + scratch[n - 1];
+    allocator.deallocate(scratch, n);
+    return result;
+}
+
+template <class Allocator>
+void ScratchBenchmark(const std::string & name, size_t num_walks) {
+    Allocator allocator;
+    Report(name, TimeMilliseconds([&]() {
+        volatile int sink = 0;
+        for (size_t k = 0; k < num_walks; ++k) {
+            sink = sink + NestedScratch(allocator, 8);
+        }
+    }));
+}
+
+void RunScratchBenchmarks() {
+    const size_t num_walks = 500000;
+
+    std::cout << "Nested scratch buffers (" << num_walks << " walks, 8 levels)" << std::endl;
+    ScratchBenchmark<std::allocator<int>>("std::allocator", num_walks);
+    ScratchBenchmark<Mallocator::Mallocator<int>>("Mallocator", num_walks);
+    ScratchBenchmark<SizeClassAllocator::SizeClassAllocator<int, Mallocator::Mallocator>>("SizeClassAllocator", num_walks);
+    ScratchBenchmark<StackAllocator::StackAllocator<int, Mallocator::Mallocator>>("StackAllocator", num_walks);
+}
+
+long MinorPageFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// First requests after startup, with and without a reservation. Every block is written to, which is where a page the
+// kernel has not backed yet faults, so the cold runs pay for their page faults here instead of at reserve().
+template <class Allocator, class Reserve>
+void WarmStartBenchmark(const std::string & name, size_t num_requests, Reserve && reserve) {
+    using Block = typename Allocator::value_type;
+
+    Allocator allocator;
+    WarmStart::ReservationReport report = reserve(allocator);
+
+    std::vector<Block *> blocks(num_requests);
+    long page_faults = MinorPageFaults();
+    double worst_microseconds = 0.0;
+    double milliseconds = TimeMilliseconds([&]() {
+        for (size_t k = 0; k < num_requests; ++k) {
+            double microseconds = 1000.0 * TimeMilliseconds([&]() {
+                blocks[k] = allocator.allocate(1);
+                memset(blocks[k], 0xab, sizeof(Block));
+            });
+            worst_microseconds = std::max(worst_microseconds, microseconds);
+        }
+    });
+    page_faults = MinorPageFaults() - page_faults;
+
+    std::cout << "  " << name << ": " << report << ", first requests " << milliseconds << " ms, worst "
+              << worst_microseconds << " us, " << page_faults << " page faults" << std::endl;
+
+    for (Block * block : blocks) {
+        allocator.deallocate(block, 1);
+    }
+}
+
+void RunWarmStartBenchmarks() {
+    struct Block {
+        char bytes[256];
+    };
+
+    const size_t num_requests = 16384;
+
+    WarmStart::ReserveOptions prefault;
+    WarmStart::ReserveOptions lock;
+    lock.lock = true;
+
+    std::cout << "Warm start (" << num_requests << " requests of " << sizeof(Block) << " bytes)" << std::endl;
+
+    using SizeClass = SizeClassAllocator::SizeClassAllocator<Block, Mallocator::Mallocator>;
+    const size_t size_class_slabs = (num_requests + SizeClasses::ClassToObjectsPerSlab(SizeClasses::SizeToClass(sizeof(Block))) - 1)
+        / SizeClasses::ClassToObjectsPerSlab(SizeClasses::SizeToClass(sizeof(Block)));
+    WarmStartBenchmark<SizeClass>("SizeClassAllocator, no reservation", num_requests, [](SizeClass &) { return WarmStart::ReservationReport(); });
+    WarmStartBenchmark<SizeClass>("SizeClassAllocator, prefaulted", num_requests, [&](SizeClass & allocator) { return allocator.reserve(sizeof(Block), size_class_slabs, prefault); });
+    WarmStartBenchmark<SizeClass>("SizeClassAllocator, locked", num_requests, [&](SizeClass & allocator) { return allocator.reserve(sizeof(Block), size_class_slabs, lock); });
+
+    using Slab = SlabAllocator::SlabAllocator<Block, Mallocator::Mallocator>;
+    const size_t slab_slabs = (num_requests + Slab::ObjectsPerSlab() - 1) / Slab::ObjectsPerSlab();
+    WarmStartBenchmark<Slab>("SlabAllocator, no reservation", num_requests, [](Slab &) { return WarmStart::ReservationReport(); });
+    WarmStartBenchmark<Slab>("SlabAllocator, prefaulted", num_requests, [&](Slab & allocator) { return allocator.reserve(slab_slabs, prefault); });
+    WarmStartBenchmark<Slab>("SlabAllocator, locked", num_requests, [&](Slab & allocator) { return allocator.reserve(slab_slabs, lock); });
+
+    using Buddy = BuddyAllocator::BuddyAllocator<Block, 256, 8 * 1024 * 1024>;
+    WarmStartBenchmark<Buddy>("BuddyAllocator, no reservation", num_requests, [](Buddy &) { return WarmStart::ReservationReport(); });
+    WarmStartBenchmark<Buddy>("BuddyAllocator, prefaulted", num_requests, [&](Buddy & allocator) { return allocator.reserve(prefault); });
+    WarmStartBenchmark<Buddy>("BuddyAllocator, locked", num_requests, [&](Buddy & allocator) { return allocator.reserve(lock); });
+}
+} // namespace
+
+int main() {
+    // First, while the process heap is still fresh
+    RunWarmStartBenchmarks();
+    RunFalseSharingBenchmarks();
+    RunNewDeleteBenchmarks();
+    RunAllContainerBenchmarks();
+    RunEpochReclamationBenchmarks();
+    RunScratchBenchmarks();
+}
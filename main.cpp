@@ -1,11 +1,17 @@
 #include "AlignedAllocator.h"
 #include "BuddyAllocator.h"
+#include "CacheLineIsolatedAllocator.h"
+#include "GuardedSamplingAllocator.h"
 #include "Mallocator.h"
+#include "SizeClassAllocator.h"
 #include "SlabAllocator.h"
+#include "StackAllocator.h"
 #include "ThreadCachingAllocator.h"
 #include "ThreadSafeAllocator.h"
 
+#include <cstring>
 #include <iostream>
+#include <new>
 #include <vector>
 
 using namespace AllocatorBuilder;
@@ -26,17 +32,150 @@ void ExerciseSlabAllocator() {
     slab_allocator_instance.allocate(4);
 }
 
+void ExerciseSizeClassAllocator() {
+    SizeClassAllocator::SizeClassAllocator<char, Mallocator::Mallocator> size_class_allocator_instance;
+
+    std::vector<std::pair<char *, size_t>> allocations;
+    for (size_t size = 1; size <= SizeClasses::kMaxSmallSize * 2; size = size * 3 / 2 + 1) {
+        char * mem = size_class_allocator_instance.allocate(size);
+        memset(mem, 0xab, size);
+        allocations.emplace_back(mem, size);
+
+        if (size > SizeClasses::kMaxSmallSize) {
+            std::cout << size << " -> backing allocator" << std::endl;
+            continue;
+        }
+
+        size_t size_class = SizeClasses::SizeToClass(size);
+        std::cout << size << " -> class " << size_class << " (" << SizeClasses::ClassToSize(size_class) << " bytes, "
+                  << SizeClasses::ClassToSlabSize(size_class) << " byte slabs)" << std::endl;
+    }
+
+    std::cout << size_class_allocator_instance.stats() << std::endl;
+    size_class_allocator_instance.dumpHeapMap(std::cout);
+
+    for (auto & allocation : allocations) {
+        size_class_allocator_instance.deallocate(allocation.first, allocation.second);
+    }
+
+    std::cout << size_class_allocator_instance.stats() << std::endl;
+}
+
+void ExerciseStackAllocator() {
+    StackAllocator::StackAllocator<int, Mallocator::Mallocator, 4096> stack_allocator_instance;
+
+    // Strictly nested allocations free in O(1)
+    int * outer = stack_allocator_instance.allocate(4);
+    int * inner = stack_allocator_instance.allocate(4);
+    std::cout << (void *)outer << " " << (void *)inner << std::endl;
+    stack_allocator_instance.deallocate(inner, 4);
+    std::cout << "reused: " << (stack_allocator_instance.allocate(4) == inner) << std::endl;
+
+    // A frame releases everything in it at once, across segment boundaries
+    {
+        StackAllocator::StackFrame<decltype(stack_allocator_instance)> frame(stack_allocator_instance);
+        for (int k = 0; k < 100; ++k) {
+            stack_allocator_instance.allocate(64);
+        }
+    }
+    std::cout << "after frame: " << (void *)stack_allocator_instance.allocate(4) << std::endl;
+
+    // Growing a vector frees its old buffers out of order, the frame takes them back
+    {
+        StackAllocator::StackFrame<decltype(stack_allocator_instance)> frame(stack_allocator_instance);
+        std::vector<int, decltype(stack_allocator_instance)> values(stack_allocator_instance);
+        for (int k = 0; k < 1000; ++k) {
+            values.push_back(k);
+        }
+        std::cout << "vector in frame: " << values.size() << std::endl;
+    }
+}
+
+void ExerciseCacheLineIsolatedAllocator() {
+    CacheLineIsolatedAllocator::CacheLineIsolatedAllocator<int, Mallocator::Mallocator> cache_line_allocator_instance;
+
+    // A zero sized allocation gets a line of its own, so freeing it leaves its neighbours alone
+    int * before = cache_line_allocator_instance.allocate(1);
+    int * empty = cache_line_allocator_instance.allocate(0);
+    int * after = cache_line_allocator_instance.allocate(1);
+    *before = 1;
+    *after = 2;
+    std::cout << (void *)before << " " << (void *)empty << " " << (void *)after << std::endl;
+
+    cache_line_allocator_instance.deallocate(empty, 0);
+    std::cout << "neighbours after freeing allocate(0): " << *before << " " << *after << std::endl;
+
+    cache_line_allocator_instance.deallocate(after, 1);
+    cache_line_allocator_instance.deallocate(before, 1);
+}
+
 void ExerciseBuddyAllocator() {
     BuddyAllocator::BuddyAllocator<int, 16, 32> buddy_allocator_instance;
     int * array1 = buddy_allocator_instance.allocate(4);
-    int * array2 = buddy_allocator_instance.allocate(8);
     int * array3 = buddy_allocator_instance.allocate(4);
 
+    // Does not fit, the two 16 byte blocks are taken
+    try {
+        buddy_allocator_instance.allocate(8);
+    } catch (const std::bad_alloc &) {
+        std::cout << "allocate(8) failed" << std::endl;
+    }
 
     std::cout << sizeof(int) << std::endl;
     std::cout << (void *)std::addressof(array1[0]) << std::endl;
-    std::cout << (void *)std::addressof(array2[0]) << std::endl;
     std::cout << (void *)std::addressof(array3[0]) << std::endl;
+
+    std::cout << buddy_allocator_instance.stats() << std::endl;
+    buddy_allocator_instance.dumpHeapMap(std::cout);
+
+    buddy_allocator_instance.deallocate(array1, 4);
+    std::cout << buddy_allocator_instance.stats() << std::endl;
+
+    buddy_allocator_instance.deallocate(array3, 4);
+    std::cout << buddy_allocator_instance.stats() << std::endl;
+}
+
+void ExerciseBuddyAllocatorFragmentation() {
+    BuddyAllocator::BuddyAllocator<char, 64, 4096> buddy_allocator_instance;
+
+    // Fill the heap with 64 byte blocks, then free every other one: half the heap is free but nothing larger than
+    // 64 bytes can be allocated
+    std::vector<char *> blocks;
+    try {
+        for (;;) {
+            blocks.push_back(buddy_allocator_instance.allocate(48));
+        }
+    } catch (const std::bad_alloc &) {
+    }
+
+    for (size_t k = 0; k < blocks.size(); k += 2) {
+        buddy_allocator_instance.deallocate(blocks[k], 48);
+    }
+
+    std::cout << buddy_allocator_instance.stats() << std::endl;
+    buddy_allocator_instance.dumpHeapMap(std::cout);
+    try {
+        buddy_allocator_instance.allocate(128);
+        std::cout << "allocate(128) succeeded" << std::endl;
+    } catch (const std::bad_alloc &) {
+        std::cout << "allocate(128) failed" << std::endl;
+    }
+}
+
+void ExerciseGuardedSamplingAllocator() {
+    GuardedSamplingAllocator::Options options;
+    options.sample_rate = 1; // Guard everything, except each thread's first allocation
+    GuardedSamplingAllocator::Configure(options);
+
+    GuardedSamplingAllocator::GuardedSamplingAllocator<Mallocator::Mallocator<int>> guarded_allocator_instance;
+    guarded_allocator_instance.deallocate(guarded_allocator_instance.allocate(1), 1);
+
+    int * array = guarded_allocator_instance.allocate(4);
+    std::cout << GuardedSamplingAllocator::NumGuardedAllocations() << " guarded allocations" << std::endl;
+    guarded_allocator_instance.deallocate(array, 4);
+
+    // Use after free, reported with the allocation and deallocation stacks before the process dies
+    array[0] = 1;
 }
 
 void ExerciseThreadSafeAllocator() {
@@ -68,7 +207,12 @@ int main() {
     //ExerciseMallocator();
     //ExerciseAlignedAllocator();
     //ExerciseSlabAllocator();
+    //ExerciseSizeClassAllocator();
+    //ExerciseStackAllocator();
+    //ExerciseCacheLineIsolatedAllocator();
     //ExerciseBuddyAllocator();
+    //ExerciseBuddyAllocatorFragmentation();
+    //ExerciseGuardedSamplingAllocator();
     //ExerciseThreadSafeAllocator();
     ExerciseThreadCachingAllocator();
 }